@@ -84,6 +84,41 @@ handle_display_destroy (struct wl_listener *listener, void *data)
   backend_destroy (&backend->base);
 }
 
+/* Whether all Vulkan devices can import host memory. Which device xrdesktop
+ * uses is only known once it created it with the extensions enabled. */
+static bool
+devices_support_host_import (void)
+{
+  VkApplicationInfo app_info = {
+    .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+    .pApplicationName = "wxrd",
+    .apiVersion = VK_API_VERSION_1_1,
+  };
+  VkInstanceCreateInfo instance_info = {
+    .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+    .pApplicationInfo = &app_info,
+  };
+  VkInstance instance;
+  if (vkCreateInstance (&instance_info, NULL, &instance) != VK_SUCCESS) {
+    return false;
+  }
+
+  uint32_t n = 0;
+  vkEnumeratePhysicalDevices (instance, &n, NULL);
+  VkPhysicalDevice *devices = calloc (n > 0 ? n : 1, sizeof (*devices));
+  bool supported = devices != NULL && n > 0
+                   && vkEnumeratePhysicalDevices (instance, &n, devices)
+                          == VK_SUCCESS;
+  for (uint32_t i = 0; supported && i < n; i++) {
+    supported = wxrd_vk_device_has_extension (
+        devices[i], VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+  }
+
+  free (devices);
+  vkDestroyInstance (instance, NULL);
+  return supported;
+}
+
 static bool
 xrdesktop_init (struct wxrd_xr_backend *backend)
 {
@@ -104,6 +139,14 @@ xrdesktop_init (struct wxrd_xr_backend *backend)
       device_exts, VK_KHR_SAMPLER_YCBCR_CONVERSION_EXTENSION_NAME);
   device_exts
       = g_slist_append (device_exts, VK_KHR_MAINTENANCE1_EXTENSION_NAME);
+  // zero copy shm uploads, see wxrd_vk_transfer_copy_from_host
+  if (devices_support_host_import ()) {
+    device_exts = g_slist_append (device_exts,
+                                  VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+  } else {
+    wlr_log (WLR_INFO, "%s not supported, shm buffers are copied",
+             VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+  }
 
   backend->xrd_shell
       = xrd_shell_new_from_vulkan_extensions (NULL, device_exts);
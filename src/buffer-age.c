@@ -0,0 +1,113 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "buffer-age.h"
+#include "wxrd-renderer.h"
+
+void
+wxrd_buffer_age_init (struct wxrd_buffer_age *age)
+{
+  for (int i = 0; i < WXRD_BUFFER_AGE_SLOTS; i++) {
+    age->slots[i].texture = NULL;
+    pixman_region32_init (&age->slots[i].damage);
+    age->slots[i].latch_seq = 0;
+  }
+  age->latch_seq = 0;
+}
+
+void
+wxrd_buffer_age_reset (struct wxrd_buffer_age *age,
+                       struct wlr_renderer *renderer)
+{
+  for (int i = 0; i < WXRD_BUFFER_AGE_SLOTS; i++) {
+    struct wxrd_buffer_age_slot *slot = &age->slots[i];
+    if (slot->texture != NULL) {
+      wxrd_renderer_hold_texture (renderer, slot->texture);
+      g_object_unref (slot->texture);
+      slot->texture = NULL;
+    }
+    pixman_region32_clear (&slot->damage);
+    slot->latch_seq = 0;
+  }
+}
+
+void
+wxrd_buffer_age_finish (struct wxrd_buffer_age *age,
+                        struct wlr_renderer *renderer)
+{
+  wxrd_buffer_age_reset (age, renderer);
+  for (int i = 0; i < WXRD_BUFFER_AGE_SLOTS; i++) {
+    pixman_region32_fini (&age->slots[i].damage);
+  }
+}
+
+/* Unused slots first, then the least recently latched */
+static struct wxrd_buffer_age_slot *
+oldest_slot (struct wxrd_buffer_age *age)
+{
+  struct wxrd_buffer_age_slot *oldest = &age->slots[0];
+  for (int i = 0; i < WXRD_BUFFER_AGE_SLOTS; i++) {
+    struct wxrd_buffer_age_slot *slot = &age->slots[i];
+    if (slot->texture == NULL) {
+      return slot;
+    }
+    if (slot->latch_seq < oldest->latch_seq) {
+      oldest = slot;
+    }
+  }
+  return oldest;
+}
+
+GulkanTexture *
+wxrd_buffer_age_back (struct wxrd_buffer_age *age,
+                      const pixman_region32_t *damage,
+                      pixman_region32_t *out)
+{
+  struct wxrd_buffer_age_slot *back = oldest_slot (age);
+  // never the shown texture
+  if (back->texture == NULL || back->latch_seq == age->latch_seq) {
+    pixman_region32_copy (out, (pixman_region32_t *)damage);
+    return NULL;
+  }
+
+  pixman_region32_union (out, &back->damage, (pixman_region32_t *)damage);
+  return back->texture;
+}
+
+void
+wxrd_buffer_age_latched (struct wxrd_buffer_age *age,
+                         struct wlr_renderer *renderer,
+                         GulkanTexture *texture,
+                         const pixman_region32_t *damage)
+{
+  struct wxrd_buffer_age_slot *latched = NULL;
+  for (int i = 0; i < WXRD_BUFFER_AGE_SLOTS; i++) {
+    if (age->slots[i].texture == texture) {
+      latched = &age->slots[i];
+    }
+  }
+
+  if (latched == NULL) {
+    latched = oldest_slot (age);
+    if (latched->texture != NULL) {
+      wxrd_renderer_hold_texture (renderer, latched->texture);
+      g_object_unref (latched->texture);
+    }
+    latched->texture = g_object_ref (texture);
+  }
+
+  for (int i = 0; i < WXRD_BUFFER_AGE_SLOTS; i++) {
+    struct wxrd_buffer_age_slot *slot = &age->slots[i];
+    if (slot == latched) {
+      pixman_region32_clear (&slot->damage);
+    } else if (slot->texture != NULL) {
+      pixman_region32_union (&slot->damage, &slot->damage,
+                             (pixman_region32_t *)damage);
+    }
+  }
+  latched->latch_seq = ++age->latch_seq;
+}
@@ -0,0 +1,71 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef WXRD_BUFFER_AGE_H
+#define WXRD_BUFFER_AGE_H
+
+#include <pixman.h>
+#include <stdint.h>
+#include <wlr/render/wlr_renderer.h>
+
+#include <xrd.h>
+
+#include "texture-pool.h"
+
+// textures a view's shm buffers are uploaded into in turn. A view latches
+// at most once per XR frame, so the oldest one stopped being shown at least
+// WXRD_TEXTURE_RETIRE_FRAMES frames ago and no frame in flight samples it.
+#define WXRD_BUFFER_AGE_SLOTS (WXRD_TEXTURE_RETIRE_FRAMES + 1)
+
+struct wxrd_buffer_age_slot
+{
+  GulkanTexture *texture; // referenced, NULL if unused
+  // damage committed since texture was last latched
+  pixman_region32_t damage;
+  uint64_t latch_seq;
+};
+
+/* The last gulkan textures latched for a view, like the buffer age of EGL
+ * swap chains. shm damage is uploaded into the oldest one with the damage
+ * it misses instead of into the textures the XR frames in flight may still
+ * sample. */
+struct wxrd_buffer_age
+{
+  struct wxrd_buffer_age_slot slots[WXRD_BUFFER_AGE_SLOTS];
+  uint64_t latch_seq;
+};
+
+void
+wxrd_buffer_age_init (struct wxrd_buffer_age *age);
+
+/* Drops the textures once the XR frames that may sample them completed,
+ * e.g. when the view is unmapped. */
+void
+wxrd_buffer_age_reset (struct wxrd_buffer_age *age,
+                       struct wlr_renderer *renderer);
+
+void
+wxrd_buffer_age_finish (struct wxrd_buffer_age *age,
+                        struct wlr_renderer *renderer);
+
+/* Returns the texture the next buffer may be uploaded into, NULL if a new
+ * one is needed, and sets out to the damage it misses including damage
+ * committed since the last latch. */
+GulkanTexture *
+wxrd_buffer_age_back (struct wxrd_buffer_age *age,
+                      const pixman_region32_t *damage,
+                      pixman_region32_t *out);
+
+/* Records that texture is shown now, damage was committed since the last
+ * latch. */
+void
+wxrd_buffer_age_latched (struct wxrd_buffer_age *age,
+                         struct wlr_renderer *renderer,
+                         GulkanTexture *texture,
+                         const pixman_region32_t *damage);
+
+#endif
@@ -0,0 +1,266 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wlr/util/log.h>
+
+#include "commit-timing-v1-protocol.h"
+
+#include "commit-timing.h"
+#include "frame-clock.h"
+#include "server.h"
+
+#define COMMIT_TIMING_VERSION 1
+
+static const struct wp_commit_timer_v1_interface timer_impl;
+
+static struct wxrd_commit_timer *
+timer_from_resource (struct wl_resource *resource)
+{
+  assert (wl_resource_instance_of (resource, &wp_commit_timer_v1_interface,
+                                   &timer_impl));
+  return wl_resource_get_user_data (resource);
+}
+
+/* A commit is due if the XR frame presented at present_ns is the closest one
+ * to its target time. */
+static bool
+is_due (struct wxrd_server *server, int64_t target_ns, int64_t present_ns)
+{
+  return target_ns <= present_ns + server->frame_clock.period_ns / 2;
+}
+
+static void
+timer_detach_surface (struct wxrd_commit_timer *timer)
+{
+  if (timer->surface == NULL) {
+    return;
+  }
+  wl_list_remove (&timer->surface_destroy.link);
+  timer->surface = NULL;
+}
+
+static void
+timer_handle_set_timestamp (struct wl_client *client,
+                            struct wl_resource *resource,
+                            uint32_t tv_sec_hi,
+                            uint32_t tv_sec_lo,
+                            uint32_t tv_nsec)
+{
+  struct wxrd_commit_timer *timer = timer_from_resource (resource);
+  if (timer->surface == NULL) {
+    wl_resource_post_error (resource,
+                            WP_COMMIT_TIMER_V1_ERROR_SURFACE_DESTROYED,
+                            "surface destroyed");
+    return;
+  }
+
+  if (tv_nsec >= 1000000000) {
+    wl_resource_post_error (resource,
+                            WP_COMMIT_TIMER_V1_ERROR_INVALID_TIMESTAMP,
+                            "tv_nsec out of range");
+    return;
+  }
+
+  uint32_t pending_seq = timer->surface->pending.seq;
+  if (timer->has_pending_timestamp && timer->pending_seq == pending_seq) {
+    wl_resource_post_error (resource,
+                            WP_COMMIT_TIMER_V1_ERROR_TIMESTAMP_EXISTS,
+                            "timestamp already set for this commit");
+    return;
+  }
+  timer->has_pending_timestamp = true;
+  timer->pending_seq = pending_seq;
+
+  // wxrd has no wp_presentation, timestamps are taken as CLOCK_MONOTONIC
+  uint64_t tv_sec = ((uint64_t)tv_sec_hi << 32) | tv_sec_lo;
+  int64_t target_ns = (int64_t)tv_sec * 1000000000ll + tv_nsec;
+
+  // Will be shown by the next XR frame anyway, no need to hold it back.
+  // Earlier held back commits keep the order because wlroots caches every
+  // commit after a locked one.
+  struct wxrd_frame_clock *clock = &timer->server->frame_clock;
+  int64_t next_present_ns
+      = wxrd_frame_clock_next_frame_ns (clock) + clock->period_ns;
+  if (timer->states.size == 0
+      && is_due (timer->server, target_ns, next_present_ns)) {
+    return;
+  }
+
+  struct wxrd_commit_timed_state *state
+      = wl_array_add (&timer->states, sizeof (*state));
+  if (state == NULL) {
+    wl_resource_post_no_memory (resource);
+    return;
+  }
+  state->target_ns = target_ns;
+  state->seq = wlr_surface_lock_pending (timer->surface);
+}
+
+static void
+timer_handle_destroy (struct wl_client *client, struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static const struct wp_commit_timer_v1_interface timer_impl = {
+  .set_timestamp = timer_handle_set_timestamp,
+  .destroy = timer_handle_destroy,
+};
+
+static void
+timer_handle_resource_destroy (struct wl_resource *resource)
+{
+  struct wxrd_commit_timer *timer = timer_from_resource (resource);
+
+  if (timer->surface != NULL) {
+    struct wxrd_commit_timed_state *state;
+    wl_array_for_each (state, &timer->states)
+    {
+      wlr_surface_unlock_cached (timer->surface, state->seq);
+    }
+  }
+  timer_detach_surface (timer);
+
+  wl_array_release (&timer->states);
+  wl_list_remove (&timer->link);
+  free (timer);
+}
+
+static void
+timer_handle_surface_destroy (struct wl_listener *listener, void *data)
+{
+  struct wxrd_commit_timer *timer
+      = wl_container_of (listener, timer, surface_destroy);
+  timer->states.size = 0;
+  timer_detach_surface (timer);
+}
+
+static void
+manager_handle_get_timer (struct wl_client *client,
+                          struct wl_resource *manager_resource,
+                          uint32_t id,
+                          struct wl_resource *surface_resource)
+{
+  struct wxrd_server *server = wl_resource_get_user_data (manager_resource);
+  struct wlr_surface *surface = wlr_surface_from_resource (surface_resource);
+
+  struct wxrd_commit_timer *timer;
+  wl_list_for_each (timer, &server->commit_timers, link)
+  {
+    if (timer->surface == surface) {
+      wl_resource_post_error (
+          manager_resource,
+          WP_COMMIT_TIMING_MANAGER_V1_ERROR_COMMIT_TIMER_EXISTS,
+          "surface already has a commit timer");
+      return;
+    }
+  }
+
+  timer = calloc (1, sizeof (struct wxrd_commit_timer));
+  if (timer == NULL) {
+    wl_client_post_no_memory (client);
+    return;
+  }
+
+  timer->resource
+      = wl_resource_create (client, &wp_commit_timer_v1_interface,
+                            wl_resource_get_version (manager_resource), id);
+  if (timer->resource == NULL) {
+    free (timer);
+    wl_client_post_no_memory (client);
+    return;
+  }
+  wl_resource_set_implementation (timer->resource, &timer_impl, timer,
+                                  timer_handle_resource_destroy);
+
+  timer->server = server;
+  timer->surface = surface;
+  wl_array_init (&timer->states);
+
+  timer->surface_destroy.notify = timer_handle_surface_destroy;
+  wl_signal_add (&surface->events.destroy, &timer->surface_destroy);
+
+  wl_list_insert (&server->commit_timers, &timer->link);
+}
+
+static void
+manager_handle_destroy (struct wl_client *client, struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static const struct wp_commit_timing_manager_v1_interface manager_impl = {
+  .destroy = manager_handle_destroy,
+  .get_timer = manager_handle_get_timer,
+};
+
+static void
+commit_timing_manager_bind (struct wl_client *client,
+                            void *data,
+                            uint32_t version,
+                            uint32_t id)
+{
+  struct wxrd_server *server = data;
+
+  struct wl_resource *resource = wl_resource_create (
+      client, &wp_commit_timing_manager_v1_interface, version, id);
+  if (resource == NULL) {
+    wl_client_post_no_memory (client);
+    return;
+  }
+  wl_resource_set_implementation (resource, &manager_impl, server, NULL);
+}
+
+void
+wxrd_commit_timing_init (struct wxrd_server *server)
+{
+  wl_list_init (&server->commit_timers);
+  wl_global_create (server->wl_display,
+                    &wp_commit_timing_manager_v1_interface,
+                    COMMIT_TIMING_VERSION, server, commit_timing_manager_bind);
+}
+
+void
+wxrd_commit_timing_latch (struct wxrd_server *server, int64_t present_ns)
+{
+  struct wxrd_commit_timer *timer;
+  wl_list_for_each (timer, &server->commit_timers, link)
+  {
+    if (timer->surface == NULL) {
+      continue;
+    }
+
+    // cached commits are applied in order, stop at the first future one
+    size_t n_due = 0;
+    struct wxrd_commit_timed_state *state;
+    wl_array_for_each (state, &timer->states)
+    {
+      if (!is_due (server, state->target_ns, present_ns)) {
+        break;
+      }
+      n_due++;
+    }
+
+    if (n_due == 0) {
+      continue;
+    }
+
+    // Only the newest due commit will be visible in this frame. Drop each
+    // state before unlocking it, that applies the commit and runs surface
+    // listeners.
+    for (size_t i = 0; i < n_due && timer->surface != NULL; i++) {
+      struct wxrd_commit_timed_state *states = timer->states.data;
+      uint32_t seq = states[0].seq;
+      timer->states.size -= sizeof (*states);
+      memmove (states, states + 1, timer->states.size);
+      wlr_surface_unlock_cached (timer->surface, seq);
+    }
+  }
+}
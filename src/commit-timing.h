@@ -0,0 +1,50 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef WXRD_COMMIT_TIMING_H
+#define WXRD_COMMIT_TIMING_H
+
+#include <stdbool.h>
+#include <wayland-server.h>
+#include <wlr/types/wlr_surface.h>
+
+struct wxrd_server;
+
+struct wxrd_commit_timed_state
+{
+  // wlr_surface_lock_pending() seq of the held back commit
+  uint32_t seq;
+  // CLOCK_MONOTONIC target presentation time
+  int64_t target_ns;
+};
+
+struct wxrd_commit_timer
+{
+  struct wl_resource *resource;
+  struct wxrd_server *server;
+  struct wlr_surface *surface;
+
+  // a timestamp was set for the pending commit
+  bool has_pending_timestamp;
+  uint32_t pending_seq;
+
+  struct wl_array states; // wxrd_commit_timed_state, in commit order
+
+  struct wl_listener surface_destroy;
+
+  struct wl_list link; // wxrd_server.commit_timers
+};
+
+void
+wxrd_commit_timing_init (struct wxrd_server *server);
+
+/* Applies held back commits whose target time is due for the XR frame that
+ * is presented at present_ns. Future-timed commits stay cached. */
+void
+wxrd_commit_timing_latch (struct wxrd_server *server, int64_t present_ns);
+
+#endif
@@ -0,0 +1,228 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wlr/util/log.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVERT_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CONVERT_NEON
+#endif
+
+#include "convert.h"
+
+// check every converted row against the scalar conversion
+#define VALIDATE_CONVERSIONS false
+// longest row the implementations are checked with at init
+#define VALIDATE_MAX_TEXELS 67
+
+typedef void (*convert_row_func) (uint8_t *dst,
+                                  const uint8_t *src,
+                                  uint32_t n);
+
+static void
+swap32_scalar (uint8_t *dst, const uint8_t *src, uint32_t n)
+{
+  for (uint32_t i = 0; i < n; i++) {
+    dst[4 * i + 0] = src[4 * i + 3];
+    dst[4 * i + 1] = src[4 * i + 2];
+    dst[4 * i + 2] = src[4 * i + 1];
+    dst[4 * i + 3] = src[4 * i + 0];
+  }
+}
+
+static void
+expand24_scalar (uint8_t *dst, const uint8_t *src, uint32_t n)
+{
+  for (uint32_t i = 0; i < n; i++) {
+    dst[4 * i + 0] = src[3 * i + 0];
+    dst[4 * i + 1] = src[3 * i + 1];
+    dst[4 * i + 2] = src[3 * i + 2];
+    dst[4 * i + 3] = 0xff;
+  }
+}
+
+#ifdef CONVERT_X86
+__attribute__ ((target ("ssse3"))) static void
+swap32_ssse3 (uint8_t *dst, const uint8_t *src, uint32_t n)
+{
+  const __m128i mask
+      = _mm_setr_epi8 (3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  uint32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128 ((const __m128i *)(src + 4 * i));
+    _mm_storeu_si128 ((__m128i *)(dst + 4 * i), _mm_shuffle_epi8 (v, mask));
+  }
+  swap32_scalar (dst + 4 * i, src + 4 * i, n - i);
+}
+
+__attribute__ ((target ("avx2"))) static void
+swap32_avx2 (uint8_t *dst, const uint8_t *src, uint32_t n)
+{
+  const __m256i mask = _mm256_setr_epi8 (
+      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, //
+      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  uint32_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256 ((const __m256i *)(src + 4 * i));
+    _mm256_storeu_si256 ((__m256i *)(dst + 4 * i),
+                         _mm256_shuffle_epi8 (v, mask));
+  }
+  swap32_scalar (dst + 4 * i, src + 4 * i, n - i);
+}
+
+__attribute__ ((target ("ssse3"))) static void
+expand24_ssse3 (uint8_t *dst, const uint8_t *src, uint32_t n)
+{
+  const __m128i mask = _mm_setr_epi8 (0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1,
+                                      9, 10, 11, -1);
+  const __m128i alpha = _mm_set1_epi32 ((int)0xff000000);
+  uint32_t i = 0;
+  // 4 texels per step, but 16 bytes are loaded
+  for (; i + 6 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128 ((const __m128i *)(src + 3 * i));
+    v = _mm_or_si128 (_mm_shuffle_epi8 (v, mask), alpha);
+    _mm_storeu_si128 ((__m128i *)(dst + 4 * i), v);
+  }
+  expand24_scalar (dst + 4 * i, src + 3 * i, n - i);
+}
+#endif
+
+#ifdef CONVERT_NEON
+static void
+swap32_neon (uint8_t *dst, const uint8_t *src, uint32_t n)
+{
+  uint32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    vst1q_u8 (dst + 4 * i, vrev32q_u8 (vld1q_u8 (src + 4 * i)));
+  }
+  swap32_scalar (dst + 4 * i, src + 4 * i, n - i);
+}
+
+static void
+expand24_neon (uint8_t *dst, const uint8_t *src, uint32_t n)
+{
+  uint32_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    uint8x16x3_t rgb = vld3q_u8 (src + 3 * i);
+    uint8x16x4_t rgbx = { { rgb.val[0], rgb.val[1], rgb.val[2],
+                            vdupq_n_u8 (0xff) } };
+    vst4q_u8 (dst + 4 * i, rgbx);
+  }
+  expand24_scalar (dst + 4 * i, src + 3 * i, n - i);
+}
+#endif
+
+static convert_row_func swap32 = swap32_scalar;
+static convert_row_func expand24 = expand24_scalar;
+
+/* Whether func converts rows of any length and alignment exactly like
+ * reference. */
+static bool
+validate (convert_row_func func,
+          convert_row_func reference,
+          uint32_t src_bytes_per_texel)
+{
+  // one extra texel for misaligned rows
+  uint8_t src[(VALIDATE_MAX_TEXELS + 1) * 4];
+  uint8_t dst[VALIDATE_MAX_TEXELS * 4];
+  uint8_t expected[VALIDATE_MAX_TEXELS * 4];
+  for (size_t i = 0; i < sizeof (src); i++) {
+    src[i] = (uint8_t)(i * 37 + 11);
+  }
+
+  for (uint32_t n = 0; n <= VALIDATE_MAX_TEXELS; n++) {
+    for (uint32_t offset = 0; offset < src_bytes_per_texel; offset++) {
+      memset (dst, 0, sizeof (dst));
+      memset (expected, 0, sizeof (expected));
+      func (dst, src + offset, n);
+      reference (expected, src + offset, n);
+      if (memcmp (dst, expected, sizeof (dst)) != 0) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void
+wxrd_convert_init (void)
+{
+  const char *name = "scalar";
+  convert_row_func fast_swap32 = swap32_scalar;
+  convert_row_func fast_expand24 = expand24_scalar;
+
+#if defined(CONVERT_X86)
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("ssse3")) {
+    name = "SSSE3";
+    fast_swap32 = swap32_ssse3;
+    fast_expand24 = expand24_ssse3;
+  }
+  if (__builtin_cpu_supports ("avx2")) {
+    name = "AVX2";
+    fast_swap32 = swap32_avx2;
+  }
+#elif defined(CONVERT_NEON)
+  name = "NEON";
+  fast_swap32 = swap32_neon;
+  fast_expand24 = expand24_neon;
+#endif
+
+  if (!validate (fast_swap32, swap32_scalar, 4)
+      || !validate (fast_expand24, expand24_scalar, 3)) {
+    wlr_log (WLR_ERROR, "%s format conversion is broken, using scalar", name);
+    return;
+  }
+
+  wlr_log (WLR_DEBUG, "Using %s format conversion", name);
+  swap32 = fast_swap32;
+  expand24 = fast_expand24;
+}
+
+void
+wxrd_convert_row (enum wxrd_conversion conversion,
+                  uint8_t *dst,
+                  const uint8_t *src,
+                  uint32_t n)
+{
+  convert_row_func func;
+  convert_row_func reference;
+  switch (conversion) {
+  case WXRD_CONVERT_SWAP32:
+    func = swap32;
+    reference = swap32_scalar;
+    break;
+  case WXRD_CONVERT_EXPAND24:
+    func = expand24;
+    reference = expand24_scalar;
+    break;
+  default:
+    memcpy (dst, src, (size_t)n * 4);
+    return;
+  }
+
+  func (dst, src, n);
+
+  if (VALIDATE_CONVERSIONS) {
+    uint8_t *expected = malloc ((size_t)n * 4);
+    if (expected == NULL) {
+      return;
+    }
+    reference (expected, src, n);
+    if (memcmp (dst, expected, (size_t)n * 4) != 0) {
+      wlr_log (WLR_ERROR, "Conversion %d of %u texels differs from scalar",
+               conversion, n);
+    }
+    free (expected);
+  }
+}
@@ -0,0 +1,36 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef WXRD_CONVERT_H
+#define WXRD_CONVERT_H
+
+#include <stdint.h>
+
+/* How texels of a shm format without a Vulkan equivalent are converted to
+ * the 32 bit format of its texture while packing. */
+enum wxrd_conversion
+{
+  WXRD_CONVERT_NONE,
+  // reverse the bytes of each texel, e.g. BGRA8888 to ARGB8888
+  WXRD_CONVERT_SWAP32,
+  // append an opaque alpha byte to 24 bit texels, e.g. RGB888 to XRGB8888
+  WXRD_CONVERT_EXPAND24,
+};
+
+/* Picks the fastest implementation the CPU supports, after checking it
+ * against the scalar one. */
+void
+wxrd_convert_init (void);
+
+/* Converts a row of n texels from src to dst. The rows must not overlap. */
+void
+wxrd_convert_row (enum wxrd_conversion conversion,
+                  uint8_t *dst,
+                  const uint8_t *src,
+                  uint32_t n);
+
+#endif
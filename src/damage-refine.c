@@ -0,0 +1,91 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <wlr/util/log.h>
+
+#include "damage-refine.h"
+
+// damage covering this much of the surface is considered coarse
+#define COARSE_DAMAGE_PERCENT 90
+// coarse commits in a row before refinement is enabled
+#define ENABLE_COARSE_COMMITS 30
+// refined uploads the efficiency is evaluated over
+#define EVALUATE_UPLOADS 60
+// refinement is disabled if more of the damage than this really changed
+#define DISABLE_CHANGED_PERCENT 60
+// e.g. a video playing for a while, don't diff it again right away
+#define COOLDOWN_COMMITS 1200
+
+void
+wxrd_damage_refine_commit (struct wxrd_damage_refine *refine,
+                           const pixman_region32_t *damage,
+                           int width,
+                           int height)
+{
+  if (refine->cooldown_commits > 0) {
+    refine->cooldown_commits--;
+  }
+  if (refine->enabled || width <= 0 || height <= 0) {
+    return;
+  }
+
+  uint64_t damaged = 0;
+  int n_rects;
+  const pixman_box32_t *rects = pixman_region32_rectangles (damage, &n_rects);
+  for (int i = 0; i < n_rects; i++) {
+    damaged += (uint64_t)(rects[i].x2 - rects[i].x1)
+               * (rects[i].y2 - rects[i].y1);
+  }
+
+  // commits without damage, e.g. only a frame callback, don't count
+  if (damaged == 0) {
+    return;
+  }
+  if (damaged * 100 < (uint64_t)width * height * COARSE_DAMAGE_PERCENT) {
+    refine->coarse_commits = 0;
+    return;
+  }
+
+  refine->coarse_commits++;
+  if (refine->coarse_commits >= ENABLE_COARSE_COMMITS
+      && refine->cooldown_commits == 0) {
+    wlr_log (WLR_DEBUG, "Coarse damage, refining it with tile diffs");
+    refine->enabled = true;
+    refine->uploads = 0;
+    refine->damaged_pixels = 0;
+    refine->changed_pixels = 0;
+  }
+}
+
+void
+wxrd_damage_refine_uploaded (struct wxrd_damage_refine *refine,
+                             uint64_t damaged_pixels,
+                             uint64_t changed_pixels)
+{
+  if (!refine->enabled) {
+    return;
+  }
+
+  refine->uploads++;
+  refine->damaged_pixels += damaged_pixels;
+  refine->changed_pixels += changed_pixels;
+  if (refine->uploads < EVALUATE_UPLOADS) {
+    return;
+  }
+
+  if (refine->changed_pixels * 100
+      > refine->damaged_pixels * DISABLE_CHANGED_PERCENT) {
+    wlr_log (WLR_DEBUG, "%lu of %lu damaged pixels changed, stop refining",
+             refine->changed_pixels, refine->damaged_pixels);
+    refine->enabled = false;
+    refine->coarse_commits = 0;
+    refine->cooldown_commits = COOLDOWN_COMMITS;
+  }
+  refine->uploads = 0;
+  refine->damaged_pixels = 0;
+  refine->changed_pixels = 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef WXRD_DAMAGE_REFINE_H
+#define WXRD_DAMAGE_REFINE_H
+
+#include <pixman.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Decides per view whether shm damage is refined by diffing tiles against
+ * a shadow copy of the texture. Turned on for clients that keep damaging
+ * (nearly) their whole surface, e.g. many X11 apps, and off again if most
+ * of the damage turns out to really change. */
+struct wxrd_damage_refine
+{
+  bool enabled;
+
+  // consecutive commits damaging most of the surface
+  int coarse_commits;
+  // commits until it may be enabled again after it didn't pay off
+  int cooldown_commits;
+
+  // refined uploads since the last evaluation
+  int uploads;
+  uint64_t damaged_pixels;
+  uint64_t changed_pixels;
+};
+
+/* Accounts the buffer damage of a commit of a width x height buffer. */
+void
+wxrd_damage_refine_commit (struct wxrd_damage_refine *refine,
+                           const pixman_region32_t *damage,
+                           int width,
+                           int height);
+
+/* Accounts how many of the damaged pixels of a refined upload changed. */
+void
+wxrd_damage_refine_uploaded (struct wxrd_damage_refine *refine,
+                             uint64_t damaged_pixels,
+                             uint64_t changed_pixels);
+
+#endif
@@ -0,0 +1,140 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <string.h>
+#include <sys/stat.h>
+#include <wlr/util/log.h>
+
+#include "dmabuf-cache.h"
+#include "stats.h"
+
+// re-wrapped buffers are recreated right away, this only covers a few frames
+#define RETENTION_NS (500 * 1000000ll)
+#define MAX_ENTRIES 32
+
+bool
+wxrd_dmabuf_key_init (struct wxrd_dmabuf_key *key,
+                      const struct wlr_dmabuf_attributes *attribs)
+{
+  struct stat st;
+  if (attribs->n_planes < 1 || fstat (attribs->fd[0], &st) != 0) {
+    return false;
+  }
+
+  // zero the padding, keys are compared with memcmp
+  memset (key, 0, sizeof (*key));
+  key->dev = st.st_dev;
+  key->ino = st.st_ino;
+  key->offset = attribs->offset[0];
+  key->stride = attribs->stride[0];
+  key->modifier = attribs->modifier;
+  key->format = attribs->format;
+  key->width = attribs->width;
+  key->height = attribs->height;
+  key->n_planes = attribs->n_planes;
+  return true;
+}
+
+void
+wxrd_dmabuf_cache_init (struct wxrd_dmabuf_cache *cache,
+                        struct wxrd_texture_pool *pool)
+{
+  cache->pool = pool;
+  wl_array_init (&cache->entries);
+}
+
+void
+wxrd_dmabuf_cache_finish (struct wxrd_dmabuf_cache *cache)
+{
+  struct wxrd_dmabuf_cache_entry *entry;
+  wl_array_for_each (entry, &cache->entries)
+  {
+    g_object_unref (entry->texture);
+  }
+  wl_array_release (&cache->entries);
+}
+
+static void
+remove_entry (struct wxrd_dmabuf_cache *cache, size_t index)
+{
+  struct wxrd_dmabuf_cache_entry *entries = cache->entries.data;
+  size_t n = cache->entries.size / sizeof (*entries);
+
+  memmove (&entries[index], &entries[index + 1],
+           (n - index - 1) * sizeof (*entries));
+  cache->entries.size -= sizeof (*entries);
+}
+
+GulkanTexture *
+wxrd_dmabuf_cache_take (struct wxrd_dmabuf_cache *cache,
+                        const struct wxrd_dmabuf_key *key)
+{
+  struct wxrd_dmabuf_cache_entry *entries = cache->entries.data;
+  size_t n = cache->entries.size / sizeof (*entries);
+
+  for (size_t i = n; i-- > 0;) {
+    if (memcmp (&entries[i].key, key, sizeof (*key)) == 0) {
+      GulkanTexture *texture = entries[i].texture;
+      remove_entry (cache, i);
+      wxrd_stats.dmabuf_cache_hits++;
+      return texture;
+    }
+  }
+
+  wxrd_stats.dmabuf_cache_misses++;
+  return NULL;
+}
+
+void
+wxrd_dmabuf_cache_put (struct wxrd_dmabuf_cache *cache,
+                       const struct wxrd_dmabuf_key *key,
+                       GulkanTexture *texture,
+                       int64_t now_ns)
+{
+  // evict the oldest
+  if (cache->entries.size / sizeof (struct wxrd_dmabuf_cache_entry)
+      >= MAX_ENTRIES) {
+    struct wxrd_dmabuf_cache_entry *oldest = cache->entries.data;
+    // may have been put this frame
+    GulkanTexture *evicted = oldest->texture;
+    remove_entry (cache, 0);
+    wxrd_texture_pool_release (cache->pool, evicted);
+  }
+
+  struct wxrd_dmabuf_cache_entry *entry
+      = wl_array_add (&cache->entries, sizeof (*entry));
+  if (entry == NULL) {
+    g_object_unref (texture);
+    return;
+  }
+  entry->key = *key;
+  entry->texture = texture;
+  entry->expire_ns = now_ns + RETENTION_NS;
+}
+
+void
+wxrd_dmabuf_cache_expire (struct wxrd_dmabuf_cache *cache, int64_t now_ns)
+{
+  struct wxrd_dmabuf_cache_entry *entries = cache->entries.data;
+  size_t n = cache->entries.size / sizeof (*entries);
+
+  // entries are in expiry order
+  size_t n_expired = 0;
+  while (n_expired < n && entries[n_expired].expire_ns <= now_ns) {
+    n_expired++;
+  }
+  if (n_expired == 0) {
+    return;
+  }
+
+  for (size_t i = 0; i < n_expired; i++) {
+    wxrd_texture_pool_release (cache->pool, entries[i].texture);
+  }
+  memmove (entries, entries + n_expired,
+           (n - n_expired) * sizeof (*entries));
+  cache->entries.size -= n_expired * sizeof (*entries);
+}
@@ -0,0 +1,81 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef WXRD_DMABUF_CACHE_H
+#define WXRD_DMABUF_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <wayland-util.h>
+#include <wlr/render/dmabuf.h>
+
+#include <xrd.h>
+
+#include "texture-pool.h"
+
+/* Identifies the memory behind a dmabuf, not the wl_buffer wrapping it */
+struct wxrd_dmabuf_key
+{
+  dev_t dev;
+  ino_t ino;
+  uint32_t offset, stride;
+  uint64_t modifier;
+  uint32_t format;
+  int32_t width, height;
+  int n_planes;
+};
+
+/* Keeps the gulkan textures of destroyed dmabuf buffers for a while.
+ * Xwayland/glamor and some toolkits destroy and recreate wl_buffers around
+ * the same dmabufs, their new buffers reuse the imported image instead of
+ * importing it again. A cached texture keeps its dmabuf alive, so its inode
+ * can't be reused by another dmabuf. */
+struct wxrd_dmabuf_cache
+{
+  // dropped textures are retired through it
+  struct wxrd_texture_pool *pool;
+  struct wl_array entries; // struct wxrd_dmabuf_cache_entry, oldest first
+};
+
+struct wxrd_dmabuf_cache_entry
+{
+  struct wxrd_dmabuf_key key;
+  GulkanTexture *texture;
+  int64_t expire_ns;
+};
+
+/* Returns false if the dmabuf can't be identified. */
+bool
+wxrd_dmabuf_key_init (struct wxrd_dmabuf_key *key,
+                      const struct wlr_dmabuf_attributes *attribs);
+
+void
+wxrd_dmabuf_cache_init (struct wxrd_dmabuf_cache *cache,
+                        struct wxrd_texture_pool *pool);
+
+void
+wxrd_dmabuf_cache_finish (struct wxrd_dmabuf_cache *cache);
+
+/* Returns the reference to the texture imported from the same dmabuf,
+ * removing it from the cache, NULL if there is none. */
+GulkanTexture *
+wxrd_dmabuf_cache_take (struct wxrd_dmabuf_cache *cache,
+                        const struct wxrd_dmabuf_key *key);
+
+/* Takes over a reference to the texture imported from the dmabuf key. */
+void
+wxrd_dmabuf_cache_put (struct wxrd_dmabuf_cache *cache,
+                       const struct wxrd_dmabuf_key *key,
+                       GulkanTexture *texture,
+                       int64_t now_ns);
+
+/* Drops textures that were not reused in time. Called once per XR frame. */
+void
+wxrd_dmabuf_cache_expire (struct wxrd_dmabuf_cache *cache, int64_t now_ns);
+
+#endif
@@ -0,0 +1,127 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <assert.h>
+#include <drm_fourcc.h>
+#include <errno.h>
+#include <linux/dma-buf.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <wlr/util/log.h>
+
+#include "dmabuf-map.h"
+
+static const struct wlr_buffer_impl map_buffer_impl;
+
+static struct wxrd_dmabuf_map_buffer *
+map_buffer_from_buffer (struct wlr_buffer *buffer)
+{
+  assert (buffer->impl == &map_buffer_impl);
+  struct wxrd_dmabuf_map_buffer *map_buffer
+      = wl_container_of (buffer, map_buffer, base);
+  return map_buffer;
+}
+
+static bool
+dmabuf_sync (int fd, uint64_t flags)
+{
+  struct dma_buf_sync sync = { .flags = flags };
+  while (ioctl (fd, DMA_BUF_IOCTL_SYNC, &sync) != 0) {
+    if (errno != EINTR && errno != EAGAIN) {
+      wlr_log_errno (WLR_ERROR, "DMA_BUF_IOCTL_SYNC failed");
+      return false;
+    }
+  }
+  return true;
+}
+
+static void
+map_buffer_destroy (struct wlr_buffer *buffer)
+{
+  struct wxrd_dmabuf_map_buffer *map_buffer = map_buffer_from_buffer (buffer);
+  munmap (map_buffer->map, map_buffer->map_size);
+  wlr_buffer_unlock (map_buffer->source);
+  free (map_buffer);
+}
+
+static bool
+map_buffer_begin_data_ptr_access (struct wlr_buffer *buffer,
+                                  uint32_t flags,
+                                  void **data,
+                                  uint32_t *format,
+                                  size_t *stride)
+{
+  struct wxrd_dmabuf_map_buffer *map_buffer = map_buffer_from_buffer (buffer);
+  if (!dmabuf_sync (map_buffer->attribs.fd[0],
+                    DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ)) {
+    return false;
+  }
+
+  *data = (uint8_t *)map_buffer->map + map_buffer->attribs.offset[0];
+  *format = map_buffer->attribs.format;
+  *stride = map_buffer->attribs.stride[0];
+  return true;
+}
+
+static void
+map_buffer_end_data_ptr_access (struct wlr_buffer *buffer)
+{
+  struct wxrd_dmabuf_map_buffer *map_buffer = map_buffer_from_buffer (buffer);
+  dmabuf_sync (map_buffer->attribs.fd[0], DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+}
+
+static const struct wlr_buffer_impl map_buffer_impl = {
+  .destroy = map_buffer_destroy,
+  .begin_data_ptr_access = map_buffer_begin_data_ptr_access,
+  .end_data_ptr_access = map_buffer_end_data_ptr_access,
+};
+
+bool
+wxrd_dmabuf_map_supported (const struct wlr_dmabuf_attributes *attribs)
+{
+  // implicit modifiers may be tiled
+  return attribs->n_planes == 1 && attribs->modifier == DRM_FORMAT_MOD_LINEAR;
+}
+
+struct wlr_buffer *
+wxrd_dmabuf_map_buffer_create (struct wlr_buffer *source)
+{
+  struct wlr_dmabuf_attributes attribs;
+  if (!wlr_buffer_get_dmabuf (source, &attribs)
+      || !wxrd_dmabuf_map_supported (&attribs)) {
+    return NULL;
+  }
+
+  // the plane offset need not be page aligned, map from the start
+  size_t map_size
+      = attribs.offset[0] + (size_t)attribs.stride[0] * attribs.height;
+  void *map = mmap (NULL, map_size, PROT_READ, MAP_SHARED, attribs.fd[0], 0);
+  if (map == MAP_FAILED) {
+    wlr_log_errno (WLR_ERROR, "Failed to mmap dmabuf");
+    return NULL;
+  }
+
+  struct wxrd_dmabuf_map_buffer *map_buffer
+      = calloc (1, sizeof (struct wxrd_dmabuf_map_buffer));
+  if (map_buffer == NULL) {
+    munmap (map, map_size);
+    return NULL;
+  }
+  wlr_buffer_init (&map_buffer->base, &map_buffer_impl, attribs.width,
+                   attribs.height);
+  map_buffer->source = wlr_buffer_lock (source);
+  map_buffer->attribs = attribs;
+  map_buffer->map = map;
+  map_buffer->map_size = map_size;
+
+  // destroyed with the last lock
+  wlr_buffer_lock (&map_buffer->base);
+  wlr_buffer_drop (&map_buffer->base);
+  return &map_buffer->base;
+}
@@ -0,0 +1,40 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef WXRD_DMABUF_MAP_H
+#define WXRD_DMABUF_MAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <wlr/render/dmabuf.h>
+#include <wlr/types/wlr_buffer.h>
+
+/* Reads a linear dmabuf the Vulkan device can't import through a CPU
+ * mapping, so it can take the shm upload path. Data pointer accesses are
+ * bracketed with DMA_BUF_IOCTL_SYNC. */
+struct wxrd_dmabuf_map_buffer
+{
+  struct wlr_buffer base;
+
+  // locked, keeps the dmabuf and its fds alive
+  struct wlr_buffer *source;
+  struct wlr_dmabuf_attributes attribs;
+
+  void *map;
+  size_t map_size;
+};
+
+/* Whether a dmabuf with these attributes can be mapped and read linearly */
+bool
+wxrd_dmabuf_map_supported (const struct wlr_dmabuf_attributes *attribs);
+
+/* Returns a locked buffer mapping the dmabuf of source, destroyed when its
+ * last lock is released. NULL if the dmabuf can't be mapped. */
+struct wlr_buffer *
+wxrd_dmabuf_map_buffer_create (struct wlr_buffer *source);
+
+#endif
@@ -0,0 +1,260 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wlr/util/log.h>
+
+#include "fifo-v1-protocol.h"
+
+#include "fifo.h"
+#include "server.h"
+
+#define FIFO_VERSION 1
+
+static const struct wp_fifo_v1_interface fifo_impl;
+
+static struct wxrd_fifo *
+fifo_from_resource (struct wl_resource *resource)
+{
+  assert (wl_resource_instance_of (resource, &wp_fifo_v1_interface,
+                                   &fifo_impl));
+  return wl_resource_get_user_data (resource);
+}
+
+static void
+fifo_unlock_all (struct wxrd_fifo *fifo)
+{
+  uint32_t *seq;
+  wl_array_for_each (seq, &fifo->locks)
+  {
+    wlr_surface_unlock_cached (fifo->surface, *seq);
+  }
+  fifo->locks.size = 0;
+}
+
+static void
+fifo_detach_surface (struct wxrd_fifo *fifo)
+{
+  if (fifo->surface == NULL) {
+    return;
+  }
+  wl_list_remove (&fifo->surface_commit.link);
+  wl_list_remove (&fifo->surface_destroy.link);
+  fifo->surface = NULL;
+}
+
+static void
+fifo_handle_set_barrier (struct wl_client *client,
+                         struct wl_resource *resource)
+{
+  struct wxrd_fifo *fifo = fifo_from_resource (resource);
+  if (fifo->surface == NULL) {
+    wl_resource_post_error (resource, WP_FIFO_V1_ERROR_SURFACE_DESTROYED,
+                            "surface destroyed");
+    return;
+  }
+
+  fifo->barrier_pending = true;
+  fifo->barrier_pending_seq = fifo->surface->pending.seq;
+}
+
+static void
+fifo_handle_wait_barrier (struct wl_client *client,
+                          struct wl_resource *resource)
+{
+  struct wxrd_fifo *fifo = fifo_from_resource (resource);
+  if (fifo->surface == NULL) {
+    wl_resource_post_error (resource, WP_FIFO_V1_ERROR_SURFACE_DESTROYED,
+                            "surface destroyed");
+    return;
+  }
+
+  // only a barrier set by an earlier commit holds this one back, one set
+  // in the same commit is waited for by the next commit
+  bool earlier_barrier
+      = fifo->barrier
+        || (fifo->barrier_pending
+            && fifo->barrier_pending_seq != fifo->surface->pending.seq);
+  if (!earlier_barrier && fifo->locks.size == 0) {
+    return;
+  }
+
+  // hold back the commit this request belongs to without blocking the
+  // client, it will be applied in wxrd_fifo_latch
+  uint32_t *seq = wl_array_add (&fifo->locks, sizeof (*seq));
+  if (seq == NULL) {
+    wl_resource_post_no_memory (resource);
+    return;
+  }
+  *seq = wlr_surface_lock_pending (fifo->surface);
+}
+
+static void
+fifo_handle_destroy (struct wl_client *client, struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static const struct wp_fifo_v1_interface fifo_impl = {
+  .set_barrier = fifo_handle_set_barrier,
+  .wait_barrier = fifo_handle_wait_barrier,
+  .destroy = fifo_handle_destroy,
+};
+
+static void
+fifo_handle_resource_destroy (struct wl_resource *resource)
+{
+  struct wxrd_fifo *fifo = fifo_from_resource (resource);
+
+  // don't leave commits locked forever when the client stops using fifo
+  if (fifo->surface != NULL) {
+    fifo_unlock_all (fifo);
+  }
+  fifo_detach_surface (fifo);
+
+  wl_array_release (&fifo->locks);
+  wl_list_remove (&fifo->link);
+  free (fifo);
+}
+
+static void
+fifo_handle_surface_commit (struct wl_listener *listener, void *data)
+{
+  struct wxrd_fifo *fifo = wl_container_of (listener, fifo, surface_commit);
+
+  if (!fifo->barrier_pending) {
+    return;
+  }
+
+  int32_t diff
+      = (int32_t)(fifo->surface->current.seq - fifo->barrier_pending_seq);
+  if (diff >= 0) {
+    fifo->barrier = true;
+    fifo->barrier_pending = false;
+  }
+}
+
+static void
+fifo_handle_surface_destroy (struct wl_listener *listener, void *data)
+{
+  struct wxrd_fifo *fifo = wl_container_of (listener, fifo, surface_destroy);
+  // cached states are discarded together with the surface
+  fifo->locks.size = 0;
+  fifo_detach_surface (fifo);
+}
+
+static void
+manager_handle_get_fifo (struct wl_client *client,
+                         struct wl_resource *manager_resource,
+                         uint32_t id,
+                         struct wl_resource *surface_resource)
+{
+  struct wxrd_server *server = wl_resource_get_user_data (manager_resource);
+  struct wlr_surface *surface = wlr_surface_from_resource (surface_resource);
+
+  struct wxrd_fifo *fifo;
+  wl_list_for_each (fifo, &server->fifos, link)
+  {
+    if (fifo->surface == surface) {
+      wl_resource_post_error (manager_resource,
+                              WP_FIFO_MANAGER_V1_ERROR_ALREADY_EXISTS,
+                              "surface already has a fifo object");
+      return;
+    }
+  }
+
+  fifo = calloc (1, sizeof (struct wxrd_fifo));
+  if (fifo == NULL) {
+    wl_client_post_no_memory (client);
+    return;
+  }
+
+  fifo->resource
+      = wl_resource_create (client, &wp_fifo_v1_interface,
+                            wl_resource_get_version (manager_resource), id);
+  if (fifo->resource == NULL) {
+    free (fifo);
+    wl_client_post_no_memory (client);
+    return;
+  }
+  wl_resource_set_implementation (fifo->resource, &fifo_impl, fifo,
+                                  fifo_handle_resource_destroy);
+
+  fifo->server = server;
+  fifo->surface = surface;
+  wl_array_init (&fifo->locks);
+
+  fifo->surface_commit.notify = fifo_handle_surface_commit;
+  wl_signal_add (&surface->events.commit, &fifo->surface_commit);
+  fifo->surface_destroy.notify = fifo_handle_surface_destroy;
+  wl_signal_add (&surface->events.destroy, &fifo->surface_destroy);
+
+  wl_list_insert (&server->fifos, &fifo->link);
+}
+
+static void
+manager_handle_destroy (struct wl_client *client, struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static const struct wp_fifo_manager_v1_interface fifo_manager_impl = {
+  .destroy = manager_handle_destroy,
+  .get_fifo = manager_handle_get_fifo,
+};
+
+static void
+fifo_manager_bind (struct wl_client *client,
+                   void *data,
+                   uint32_t version,
+                   uint32_t id)
+{
+  struct wxrd_server *server = data;
+
+  struct wl_resource *resource
+      = wl_resource_create (client, &wp_fifo_manager_v1_interface, version, id);
+  if (resource == NULL) {
+    wl_client_post_no_memory (client);
+    return;
+  }
+  wl_resource_set_implementation (resource, &fifo_manager_impl, server, NULL);
+}
+
+void
+wxrd_fifo_init (struct wxrd_server *server)
+{
+  wl_list_init (&server->fifos);
+  wl_global_create (server->wl_display, &wp_fifo_manager_v1_interface,
+                    FIFO_VERSION, server, fifo_manager_bind);
+}
+
+void
+wxrd_fifo_latch (struct wxrd_server *server)
+{
+  struct wxrd_fifo *fifo;
+  wl_list_for_each (fifo, &server->fifos, link)
+  {
+    if (fifo->surface == NULL) {
+      continue;
+    }
+
+    fifo->barrier = false;
+
+    // Apply waiting commits in order until one of them sets a new barrier,
+    // that one will be released on the next XR frame.
+    // The commit listener runs from wlr_surface_unlock_cached.
+    while (fifo->locks.size > 0 && !fifo->barrier) {
+      uint32_t *locks = fifo->locks.data;
+      uint32_t seq = locks[0];
+      fifo->locks.size -= sizeof (uint32_t);
+      memmove (locks, locks + 1, fifo->locks.size);
+      wlr_surface_unlock_cached (fifo->surface, seq);
+    }
+  }
+}
@@ -0,0 +1,47 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef WXRD_FIFO_H
+#define WXRD_FIFO_H
+
+#include <stdbool.h>
+#include <wayland-server.h>
+#include <wlr/types/wlr_surface.h>
+
+struct wxrd_server;
+
+struct wxrd_fifo
+{
+  struct wl_resource *resource;
+  struct wxrd_server *server;
+  struct wlr_surface *surface;
+
+  // set by an applied commit that carried set_barrier, cleared on latch
+  bool barrier;
+
+  // surface->pending.seq of the commit that requested set_barrier
+  bool barrier_pending;
+  uint32_t barrier_pending_seq;
+
+  // wlr_surface_lock_pending() seqs of commits waiting for the barrier
+  struct wl_array locks; // uint32_t
+
+  struct wl_listener surface_commit;
+  struct wl_listener surface_destroy;
+
+  struct wl_list link; // wxrd_server.fifos
+};
+
+void
+wxrd_fifo_init (struct wxrd_server *server);
+
+/* Clears all fifo barriers and applies the commits waiting for them.
+ * Called at the XR frame start, before the view textures are latched. */
+void
+wxrd_fifo_latch (struct wxrd_server *server);
+
+#endif
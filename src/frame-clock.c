@@ -0,0 +1,51 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "frame-clock.h"
+
+// intervals longer than this many periods are stalls (e.g. the runtime
+// stopped rendering), not a change in refresh rate.
+#define MAX_PERIOD_FACTOR 3
+
+void
+wxrd_frame_clock_init (struct wxrd_frame_clock *clock)
+{
+  clock->last_frame_start_ns = 0;
+  clock->period_ns = WXRD_FRAME_CLOCK_DEFAULT_PERIOD_NS;
+  clock->last_interval_ns = 0;
+  clock->frame_count = 0;
+}
+
+void
+wxrd_frame_clock_tick (struct wxrd_frame_clock *clock, int64_t now_ns)
+{
+  if (clock->last_frame_start_ns != 0) {
+    int64_t interval = now_ns - clock->last_frame_start_ns;
+    clock->last_interval_ns = interval;
+    if (interval > 0 && interval < clock->period_ns * MAX_PERIOD_FACTOR) {
+      // exponential moving average, weight 1/8 for the new sample
+      clock->period_ns += (interval - clock->period_ns) / 8;
+    }
+  }
+
+  clock->last_frame_start_ns = now_ns;
+  clock->frame_count++;
+}
+
+int64_t
+wxrd_frame_clock_next_frame_ns (struct wxrd_frame_clock *clock)
+{
+  return clock->last_frame_start_ns + clock->period_ns;
+}
+
+bool
+wxrd_frame_clock_missed (struct wxrd_frame_clock *clock)
+{
+  // half a period of jitter is tolerated, stalls are not misses
+  return clock->last_interval_ns > clock->period_ns * 3 / 2
+         && clock->last_interval_ns < clock->period_ns * MAX_PERIOD_FACTOR;
+}
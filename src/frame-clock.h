@@ -0,0 +1,52 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef WXRD_FRAME_CLOCK_H
+#define WXRD_FRAME_CLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// used until the XR runtime delivered enough frames to measure its rate
+#define WXRD_FRAME_CLOCK_DEFAULT_PERIOD_NS (1000000000ll / 90)
+
+/* Tracks the XR runtime's frame start events (G3K_RENDER_EVENT_FRAME_START).
+ * The runtime's refresh is not exposed by xrdesktop, therefore the period is
+ * measured from the intervals between frame starts. */
+struct wxrd_frame_clock
+{
+  // CLOCK_MONOTONIC timestamp of the last frame start, 0 before the first
+  int64_t last_frame_start_ns;
+  // smoothed interval between frame starts
+  int64_t period_ns;
+  // unsmoothed interval before the last frame start, 0 if unknown
+  int64_t last_interval_ns;
+  uint64_t frame_count;
+};
+
+static inline int64_t
+timespec_to_nsec (const struct timespec *a)
+{
+  return (int64_t)a->tv_sec * 1000000000ll + (int64_t)a->tv_nsec;
+}
+
+void
+wxrd_frame_clock_init (struct wxrd_frame_clock *clock);
+
+void
+wxrd_frame_clock_tick (struct wxrd_frame_clock *clock, int64_t now_ns);
+
+/* Predicted CLOCK_MONOTONIC time of the next frame start. */
+int64_t
+wxrd_frame_clock_next_frame_ns (struct wxrd_frame_clock *clock);
+
+/* Whether the last frame start came late enough that a frame was missed. */
+bool
+wxrd_frame_clock_missed (struct wxrd_frame_clock *clock);
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <wlr/util/log.h>
+
+#include "frame-scheduler.h"
+#include "server.h"
+#include "stats.h"
+#include "view.h"
+
+// a commit later than this many XR frames after the frame callback was not
+// an attempt to make the next latch
+#define IDLE_PERIODS 2
+
+static void
+send_frame_done_iterator (struct wlr_surface *surface,
+                          int sx,
+                          int sy,
+                          void *data)
+{
+  struct timespec *t = data;
+  wlr_surface_send_frame_done (surface, t);
+}
+
+static void
+send_frame_done (struct wxrd_server *server)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  struct wxrd_view *view;
+  wl_list_for_each (view, &server->views, link)
+  {
+    if (!view->mapped || view_get_surface (view) == NULL) {
+      continue;
+    }
+
+    // A view that did not commit since its last frame callback has no new
+    // callbacks to be done, keep measuring from the first one.
+    if (!view->frame_pending) {
+      view->frame_pending = true;
+      view->frame_done_ns = timespec_to_nsec (&now);
+      view->latches_since_frame_done = 0;
+    }
+
+    wxrd_view_for_each_surface (view, send_frame_done_iterator, &now);
+  }
+}
+
+static int
+handle_frame_timer (void *data)
+{
+  struct wxrd_server *server = data;
+  send_frame_done (server);
+  return 0;
+}
+
+void
+wxrd_frame_scheduler_init (struct wxrd_server *server, int max_render_time_ms)
+{
+  server->frame_scheduler.max_render_time_ms = max_render_time_ms;
+  server->frame_scheduler.timer = NULL;
+
+  if (max_render_time_ms > 0) {
+    struct wl_event_loop *loop = wl_display_get_event_loop (server->wl_display);
+    server->frame_scheduler.timer
+        = wl_event_loop_add_timer (loop, handle_frame_timer, server);
+    wlr_log (WLR_INFO, "Sending frame callbacks %d ms before XR frame start",
+             max_render_time_ms);
+  }
+}
+
+void
+wxrd_frame_scheduler_finish (struct wxrd_server *server)
+{
+  if (server->frame_scheduler.timer != NULL) {
+    wl_event_source_remove (server->frame_scheduler.timer);
+    server->frame_scheduler.timer = NULL;
+  }
+}
+
+void
+wxrd_frame_scheduler_latched (struct wxrd_server *server)
+{
+  // clients that got a frame callback and did not commit yet missed this
+  // latch, unless they don't commit at all
+  struct wxrd_view *view;
+  wl_list_for_each (view, &server->views, link)
+  {
+    if (view->frame_pending) {
+      view->latches_since_frame_done++;
+    }
+  }
+
+  if (server->frame_scheduler.timer == NULL) {
+    send_frame_done (server);
+    return;
+  }
+
+  // Send frame callbacks as late as possible so the committed content is
+  // fresh, but early enough for clients to render within max_render_time.
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  int64_t deadline_ns = wxrd_frame_clock_next_frame_ns (&server->frame_clock)
+                        - server->frame_scheduler.max_render_time_ms
+                              * 1000000ll;
+  int64_t delay_ms = (deadline_ns - timespec_to_nsec (&now)) / 1000000;
+
+  if (delay_ms <= 0) {
+    send_frame_done (server);
+    return;
+  }
+
+  wl_event_source_timer_update (server->frame_scheduler.timer, delay_ms);
+}
+
+void
+wxrd_frame_scheduler_view_commit (struct wxrd_view *view)
+{
+  if (!view->frame_pending) {
+    return;
+  }
+  view->frame_pending = false;
+
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  int64_t render_ns = timespec_to_nsec (&now) - view->frame_done_ns;
+
+  if (view->latches_since_frame_done == 0) {
+    view->frames_hit++;
+    wxrd_stats.frames_hit++;
+  } else if (render_ns
+             < IDLE_PERIODS * view->server->frame_clock.period_ns) {
+    view->frames_missed++;
+    wxrd_stats.frames_missed++;
+  }
+  // else the client was idle and did not try to make the latch
+}
@@ -0,0 +1,31 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef WXRD_FRAME_SCHEDULER_H
+#define WXRD_FRAME_SCHEDULER_H
+
+struct wxrd_server;
+struct wxrd_view;
+
+/* max_render_time_ms: time clients get between their frame callback and the
+ * next XR frame start. 0 sends frame callbacks right after the latch. */
+void
+wxrd_frame_scheduler_init (struct wxrd_server *server, int max_render_time_ms);
+
+void
+wxrd_frame_scheduler_finish (struct wxrd_server *server);
+
+/* Called after the view textures were latched at the XR frame start.
+ * Schedules the frame callbacks for the next frame. */
+void
+wxrd_frame_scheduler_latched (struct wxrd_server *server);
+
+/* Called for every commit of a mapped view's surface */
+void
+wxrd_frame_scheduler_view_commit (struct wxrd_view *view);
+
+#endif
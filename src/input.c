@@ -394,7 +394,17 @@ cursor_reset (struct wxrd_cursor *cursor)
 
   wl_list_remove (&cursor->surface_destroy.link);
   wl_list_init (&cursor->surface_destroy.link);
+  wl_list_remove (&cursor->surface_commit.link);
+  wl_list_init (&cursor->surface_commit.link);
   cursor->surface = NULL;
+
+  // the textures hold images of the previous surface
+  struct wlr_renderer *renderer = cursor->server->xr_backend->renderer;
+  cursor->dirty = false;
+  pixman_region32_clear (&cursor->damage);
+  wxrd_buffer_age_reset (&cursor->buffer_age, renderer);
+  wxrd_renderer_hold_buffer (renderer, cursor->shown_buffer);
+  cursor->shown_buffer = NULL;
 }
 
 void
@@ -432,17 +442,16 @@ wxrd_cursor_set_xcursor (struct wxrd_cursor *cursor,
   G3kCursor *xrd_cursor
       = xrd_shell_get_desktop_cursor (cursor->server->xr_backend->xrd_shell);
 
-  // HACK This would normally leak the texture freed by
-  // g3k_cursor_set_and_submit_texture. wlroots keeps the
-  // wlr_texture around and reuses it. Therefore we have to keep it
-  // wxrd_texture->gk around too. wlroots will eventually call
-  // wxrd_texture_destroy, where we will free it.
+  // g3k unrefs the current texture, frames in flight may still sample it.
+  // The cursor takes over a reference, wlroots keeps the wlr_texture around
+  // and reuses it.
   GulkanTexture *curr_tex = g3k_cursor_get_texture (xrd_cursor);
-  if (curr_tex) {
-    g_object_ref (curr_tex);
+  if (curr_tex != NULL && curr_tex != t->gk) {
+    wxrd_renderer_hold_texture (cursor->server->xr_backend->renderer,
+                                curr_tex);
   }
 
-  g3k_cursor_set_and_submit_texture (xrd_cursor, t->gk);
+  g3k_cursor_set_and_submit_texture (xrd_cursor, g_object_ref (t->gk));
 
   g3k_cursor_set_hotspot (xrd_cursor, cursor->hotspot_x, cursor->hotspot_y);
   // wlr_log(WLR_DEBUG, "Setting cursor hotspot %d,%d", hotspot_x,
@@ -460,49 +469,106 @@ cursor_handle_surface_destroy (struct wl_listener *listener, void *data)
 }
 
 void
-wxrd_cursor_set_surface (struct wxrd_cursor *cursor,
-                         struct wlr_surface *surface,
-                         int hotspot_x,
-                         int hotspot_y)
+wxrd_cursor_latch (struct wxrd_cursor *cursor)
 {
-  cursor_reset (cursor);
-
-  cursor->surface = surface;
-  cursor->hotspot_x = hotspot_x;
-  cursor->hotspot_y = hotspot_y;
-
-  if (cursor->surface) {
-    cursor->surface_destroy.notify = cursor_handle_surface_destroy;
-    wl_signal_add (&surface->events.destroy, &cursor->surface_destroy);
+  if (!cursor->dirty || cursor->surface == NULL) {
+    return;
   }
 
-  struct wlr_texture *tex = wlr_surface_get_texture (surface);
+  struct wlr_texture *tex = wlr_surface_get_texture (cursor->surface);
   if (!tex) {
     wlr_log (WLR_DEBUG, "No cursor texture");
+    cursor->dirty = false;
     return;
   }
 
+  struct wxrd_server *server = cursor->server;
+  struct wlr_renderer *renderer = server->xr_backend->renderer;
   struct wxrd_texture *t = wxrd_get_texture (tex);
 
-  wlr_log (WLR_DEBUG, "Setting cursor texture with hotspot %d,%d (%p, %p)",
-           hotspot_x, hotspot_y, (void *)t, (void *)t->gk);
+  // keeps showing the previous image
+  if (wxrd_texture_importing (t)) {
+    return;
+  }
 
-  G3kCursor *xrd_cursor
-      = xrd_shell_get_desktop_cursor (cursor->server->xr_backend->xrd_shell);
+  // like views, never upload into the texture frames in flight sample
+  pixman_region32_t damage;
+  pixman_region32_init (&damage);
+  GulkanTexture *back_gk
+      = wxrd_buffer_age_back (&cursor->buffer_age, &cursor->damage, &damage);
+
+  uint64_t cost = wxrd_texture_latch_cost (t, back_gk, &damage);
+  bool latched = wxrd_upload_scheduler_take (&server->upload_scheduler, cost)
+                 && wxrd_texture_latch (t, back_gk, &damage);
+  pixman_region32_fini (&damage);
+  if (!latched) {
+    wlr_log (WLR_DEBUG, "Cursor texture not uploaded");
+    return;
+  }
+
+  cursor->dirty = false;
+  wxrd_buffer_age_latched (&cursor->buffer_age, renderer, t->gk,
+                           &cursor->damage);
+  pixman_region32_clear (&cursor->damage);
+
+  // see wxrd_submit_view_textures
+  if (t->buffer != cursor->shown_buffer) {
+    wxrd_renderer_hold_buffer (renderer, cursor->shown_buffer);
+    cursor->shown_buffer = wxrd_texture_lock_sampled_buffer (t);
+  }
 
-  // HACK This would normally leak the texture freed by
-  // g3k_cursor_set_and_submit_texture. wlroots keeps the
-  // wlr_texture around and reuses it. Therefore we have to keep it
-  // wxrd_texture->gk around too. wlroots will eventually call
-  // wxrd_texture_destroy, where we will free it.
+  G3kCursor *xrd_cursor
+      = xrd_shell_get_desktop_cursor (server->xr_backend->xrd_shell);
   GulkanTexture *curr_tex = g3k_cursor_get_texture (xrd_cursor);
-  if (curr_tex) {
-    g_object_ref (curr_tex);
+  if (curr_tex != t->gk) {
+    wlr_log (WLR_DEBUG, "Setting cursor texture with hotspot %d,%d (%p, %p)",
+             cursor->hotspot_x, cursor->hotspot_y, (void *)t, (void *)t->gk);
+
+    // see wxrd_cursor_set_xcursor
+    if (curr_tex) {
+      wxrd_renderer_hold_texture (renderer, curr_tex);
+    }
+    g3k_cursor_set_and_submit_texture (xrd_cursor, g_object_ref (t->gk));
+  }
+
+  g3k_cursor_set_hotspot (xrd_cursor, cursor->hotspot_x, cursor->hotspot_y);
+}
+
+static void
+cursor_handle_surface_commit (struct wl_listener *listener, void *data)
+{
+  struct wxrd_cursor *cursor
+      = wl_container_of (listener, cursor, surface_commit);
+  // uploaded at the next XR frame start, only the newest buffer is used
+  pixman_region32_union (&cursor->damage, &cursor->damage,
+                         &cursor->surface->buffer_damage);
+  cursor->dirty = true;
+}
+
+void
+wxrd_cursor_set_surface (struct wxrd_cursor *cursor,
+                         struct wlr_surface *surface,
+                         int hotspot_x,
+                         int hotspot_y)
+{
+  cursor_reset (cursor);
+
+  cursor->surface = surface;
+  cursor->hotspot_x = hotspot_x;
+  cursor->hotspot_y = hotspot_y;
+
+  if (!cursor->surface) {
+    return;
   }
 
-  g3k_cursor_set_and_submit_texture (xrd_cursor, t->gk);
+  cursor->surface_destroy.notify = cursor_handle_surface_destroy;
+  wl_signal_add (&surface->events.destroy, &cursor->surface_destroy);
+  // animated cursors commit new buffers without a new set_cursor request
+  cursor->surface_commit.notify = cursor_handle_surface_commit;
+  wl_signal_add (&surface->events.commit, &cursor->surface_commit);
 
-  g3k_cursor_set_hotspot (xrd_cursor, hotspot_x, hotspot_y);
+  // the buffer age was reset, the whole buffer is uploaded
+  cursor->dirty = true;
 }
 
 struct wlr_texture *
@@ -842,6 +908,9 @@ wxrd_input_init (struct wxrd_server *server)
 
   server->cursor.server = server;
   wl_list_init (&server->cursor.surface_destroy.link);
+  wl_list_init (&server->cursor.surface_commit.link);
+  pixman_region32_init (&server->cursor.damage);
+  wxrd_buffer_age_init (&server->cursor.buffer_age);
 
   server->new_input.notify = handle_new_input;
   wl_signal_add (&server->backend->events.new_input, &server->new_input);
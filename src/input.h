@@ -9,10 +9,13 @@
 #ifndef _WXRC_INPUT_H
 #define _WXRC_INPUT_H
 
+#include <pixman.h>
 #include <wayland-server.h>
 #include <wlr/types/wlr_input_device.h>
 #include <wlr/types/wlr_xcursor_manager.h>
 
+#include "buffer-age.h"
+
 struct wxrd_server;
 
 enum wxrd_seatop
@@ -55,6 +58,16 @@ struct wxrd_cursor
   struct wlr_surface *surface;
   int hotspot_x, hotspot_y;
   struct wl_listener surface_destroy;
+  struct wl_listener surface_commit;
+
+  // the surface committed since its texture was last latched
+  bool dirty;
+  // buffer damage of commits since the last latch
+  pixman_region32_t damage;
+  // the textures the surface's shm buffers are uploaded into
+  struct wxrd_buffer_age buffer_age;
+  // locked client buffer the shown texture samples, NULL if it is a copy
+  struct wlr_buffer *shown_buffer;
 };
 
 void
@@ -73,6 +86,12 @@ wxrd_cursor_set_surface (struct wxrd_cursor *cursor,
                          int hotspot_x,
                          int hotspot_y);
 
+/* Uploads the cursor surface's newest buffer and shows it, if it committed
+ * since the last latch. Called at the XR frame start like the views'
+ * latches, within the same upload budget. */
+void
+wxrd_cursor_latch (struct wxrd_cursor *cursor);
+
 struct wlr_texture *
 wxrd_cursor_get_texture (struct wxrd_cursor *cursor,
                          int *hotspot_x,
@@ -12,6 +12,7 @@
 #include <stdlib.h>
 
 #include <stdio.h>
+#include <math.h>
 #include <unistd.h>
 #include <signal.h>
 #include <assert.h>
@@ -45,9 +46,14 @@
 #include <GLES2/gl2.h>
 
 #include "backend.h"
+#include "commit-timing.h"
+#include "fifo.h"
+#include "frame-scheduler.h"
 #include "input.h"
 #include "output.h"
 #include "server.h"
+#include "stats.h"
+#include "upload-scheduler.h"
 #include "view.h"
 
 // input codes like BTN_LEFT
@@ -56,6 +62,9 @@
 #define USE_SHARED_GLES_TEX 0
 #define USE_DMABUF_TEX 1
 
+// main loop wakeup interval while the XR runtime is not rendering
+#define SUSPENDED_DISPATCH_TIMEOUT_MS 100
+
 static int
 handle_signal (int sig, void *data)
 {
@@ -73,9 +82,11 @@ send_geometry (struct wl_resource *resource)
 }
 
 static void
-send_all_modes (struct wl_resource *resource)
+send_all_modes (struct wl_resource *resource, struct wxrd_server *server)
 {
-  wl_output_send_mode (resource, WL_OUTPUT_MODE_CURRENT, 1920, 1080, 144000);
+  wl_output_send_mode (resource, WL_OUTPUT_MODE_CURRENT,
+                       server->output_mode.width, server->output_mode.height,
+                       server->output_mode.refresh_mhz);
 }
 
 static void
@@ -99,7 +110,7 @@ send_done (struct wl_resource *resource)
 static void
 output_handle_resource_destroy (struct wl_resource *resource)
 {
-  // This space deliberately left blank
+  wl_list_remove (wl_resource_get_link (resource));
 }
 
 static void
@@ -118,7 +129,7 @@ output_bind (struct wl_client *wl_client,
              uint32_t version,
              uint32_t id)
 {
-  struct wlr_output *output = data;
+  struct wxrd_server *server = data;
 
   struct wl_resource *resource
       = wl_resource_create (wl_client, &wl_output_interface, version, id);
@@ -126,24 +137,97 @@ output_bind (struct wl_client *wl_client,
     wl_client_post_no_memory (wl_client);
     return;
   }
-  wl_resource_set_implementation (resource, &output_impl, output,
+  wl_resource_set_implementation (resource, &output_impl, server,
                                   output_handle_resource_destroy);
+  wl_list_insert (&server->output_resources, wl_resource_get_link (resource));
 
   send_geometry (resource);
-  send_all_modes (resource);
+  send_all_modes (resource, server);
   send_scale (resource);
   send_done (resource);
 }
 
+/* Window size that fills a comfortable field of view at the distance new
+ * windows are placed at, advertised as the wl_output mode so clients size
+ * maximized and fullscreen buffers for XR. Can be overridden with
+ * WXRD_OUTPUT_SIZE=<width>x<height>. */
 static void
-send_frame_done_iterator (struct wlr_surface *surface,
-                          int sx,
-                          int sy,
-                          void *data)
+init_output_mode (struct wxrd_server *server)
 {
-  struct timespec *t = data;
-  wlr_surface_send_frame_done (surface, t);
-  // wlr_log(WLR_ERROR, "send frame done");
+  const double h_fov = 70. * M_PI / 180.;
+  const double v_fov = 50. * M_PI / 180.;
+
+  int width = 2. * WXRD_WINDOW_DISTANCE * tan (h_fov / 2.) * WXRD_SURFACE_SCALE;
+  int height
+      = 2. * WXRD_WINDOW_DISTANCE * tan (v_fov / 2.) * WXRD_SURFACE_SCALE;
+
+  const char *size_env = getenv ("WXRD_OUTPUT_SIZE");
+  if (size_env != NULL) {
+    int env_width, env_height;
+    if (sscanf (size_env, "%dx%d", &env_width, &env_height) == 2
+        && env_width > 0 && env_height > 0) {
+      width = env_width;
+      height = env_height;
+    } else {
+      wlr_log (WLR_ERROR, "Ignoring invalid WXRD_OUTPUT_SIZE %s", size_env);
+    }
+  }
+
+  server->output_mode.width = width;
+  server->output_mode.height = height;
+  server->output_mode.refresh_mhz
+      = 1000000000000ll / WXRD_FRAME_CLOCK_DEFAULT_PERIOD_NS;
+  server->output_mode.mismatch_frames = 0;
+  wl_list_init (&server->output_resources);
+
+  wlr_log (WLR_INFO, "Advertising %dx%d output", width, height);
+}
+
+// frames a refresh measurement has to be stable for before it is advertised
+#define REFRESH_SETTLE_FRAMES 90
+
+/* Follow the measured XR refresh with the advertised wl_output mode so
+ * clients pace their animations against the headset. */
+static void
+update_output_refresh (struct wxrd_server *server)
+{
+  struct wxrd_frame_clock *clock = &server->frame_clock;
+  if (clock->frame_count < REFRESH_SETTLE_FRAMES) {
+    return;
+  }
+
+  // round to full Hz, the measurement jitters
+  int32_t measured
+      = (int32_t)((1000000000000ll / clock->period_ns + 500) / 1000) * 1000;
+  int32_t advertised = server->output_mode.refresh_mhz;
+
+  wxrd_stats.measured_refresh_mhz = measured;
+  wxrd_stats.advertised_refresh_mhz = advertised;
+
+  // within 1%
+  if (abs (measured - advertised) * 100 <= advertised) {
+    server->output_mode.mismatch_frames = 0;
+    return;
+  }
+
+  wxrd_stats.refresh_mismatch_frames++;
+
+  if (++server->output_mode.mismatch_frames < REFRESH_SETTLE_FRAMES) {
+    return;
+  }
+
+  wlr_log (WLR_INFO, "XR refresh changed from %d mHz to %d mHz", advertised,
+           measured);
+
+  server->output_mode.refresh_mhz = measured;
+  server->output_mode.mismatch_frames = 0;
+
+  struct wl_resource *resource;
+  wl_resource_for_each (resource, &server->output_resources)
+  {
+    send_all_modes (resource, server);
+    send_done (resource);
+  }
 }
 
 static bool
@@ -171,15 +255,6 @@ validate_view (struct wxrd_view *wxrd_view)
     return false;
   }
 
-  struct wlr_texture *tex = surface->buffer->texture;
-  struct wxrd_texture *wxrd_tex = wxrd_get_texture (tex);
-
-  if (wxrd_tex->gk == NULL) {
-    wlr_log (WLR_ERROR, "skipping wxrd_view %p %s, gulkan texture == NULL",
-             wxrd_view, wxrd_view->title);
-    return false;
-  }
-
   if (wxrd_view->window == NULL) {
     wlr_log (WLR_ERROR, "skipping wxrd_view %p %s, XrdWindow == NULL",
              wxrd_view, wxrd_view->title);
@@ -197,6 +272,170 @@ validate_view (struct wxrd_view *wxrd_view)
   return true;
 }
 
+static struct wxrd_texture *
+view_get_wxrd_texture (struct wxrd_view *wxrd_view)
+{
+  struct wlr_surface *surface = view_get_surface (wxrd_view);
+  return wxrd_get_texture (surface->buffer->texture);
+}
+
+/* The part of a view's buffer xrdesktop shows, i.e. the xdg geometry of
+ * top level windows without client side shadows. Returns false to show the
+ * whole buffer. */
+static bool
+view_get_content_rect (struct wxrd_view *wxrd_view,
+                       struct wlr_box *box,
+                       bool verbose)
+{
+  // without client side decorations there are no shadows to leave out
+  if (wxrd_view->type != WXRD_VIEW_XDG_SHELL
+      || !wxrd_view->client_side_decorations) {
+    return false;
+  }
+
+  struct wlr_surface *surface = view_get_surface (wxrd_view);
+  struct wxrd_xdg_shell_view *shell_view = xdg_shell_view_from_view (wxrd_view);
+  if (shell_view->xdg_surface->role != WLR_XDG_SURFACE_ROLE_TOPLEVEL) {
+    return false;
+  }
+
+#if 0
+  struct wlr_fbox src_box;
+  wlr_surface_get_buffer_source_box(surface, &src_box);
+
+  wlr_log (WLR_DEBUG, "source box %f,%f %fx%f", src_box.x, src_box.y, src_box.width, src_box.height);
+
+  struct wlr_fbox buffer_source_box;
+  wlr_surface_get_buffer_source_box(surface, &buffer_source_box);
+  wlr_log (WLR_DEBUG, "buffer source box %f,%f %fx%f", buffer_source_box.x, buffer_source_box.y, buffer_source_box.width, buffer_source_box.height);
+  wlr_log (WLR_DEBUG, "buffer position %d,%d", surface->sx, surface->sy);
+
+#if 0
+  struct wlr_subsurface *subsurface;
+  wl_list_for_each (subsurface, &surface->subsurfaces_below, parent_link)
+  {
+    wlr_log (WLR_DEBUG, "subsurface %dx%d below at %d,%d", subsurface->surface->current.width, subsurface->surface->current.height, subsurface->current.x, subsurface->current.y);
+  }
+  wl_list_for_each (subsurface, &surface->subsurfaces_above, parent_link)
+  {
+    wlr_log (WLR_DEBUG, "subsurface %dx%d above at %d,%d", subsurface->surface->current.width, subsurface->surface->current.height, subsurface->current.x, subsurface->current.y);
+  }
+#endif
+#endif
+
+  wlr_xdg_surface_get_geometry (shell_view->xdg_surface, box);
+
+  // HACK (weston-simple-damage)
+  if (box->width == 0 && box->height == 0) {
+    if (verbose) {
+      wlr_log (WLR_ERROR, "geometry wlr_rect is all zero, not using geometry");
+    }
+    return false;
+  }
+
+  // if the client set geometry, it is probably on this surface.
+  // if the client did not set geometry, it defaults to a bounding box
+  // around all subsurfaces. either way, if the geometry is bigger than
+  // the texture, we don't use it.
+  // TODO: more advanced subsurface handling?
+  if (box->x < 0 || box->y < 0
+      || box->x + box->width > (int)surface->buffer->texture->width
+      || box->y + box->height > (int)surface->buffer->texture->height) {
+    if (verbose) {
+      wlr_log (WLR_ERROR,
+               "geometry wlr_rect is bigger than texture, not using geometry");
+    }
+    return false;
+  }
+
+  return true;
+}
+
+/* Returns false if the view's upload has to wait for a later frame,
+ * otherwise starts its CPU work. */
+static bool
+prepare_view_latch (struct wxrd_server *server, struct wxrd_view *wxrd_view)
+{
+  struct wxrd_texture *wxrd_tex = view_get_wxrd_texture (wxrd_view);
+
+  // Uploads and imports are deferred until now, only the newest buffer of
+  // the view is used. The damage the view's older texture misses is
+  // uploaded into it if it still fits, the shown one is left alone.
+  pixman_region32_t damage;
+  pixman_region32_init (&damage);
+  GulkanTexture *back_gk = wxrd_buffer_age_back (
+      &wxrd_view->buffer_age, &wxrd_view->buffer_damage, &damage);
+
+  wxrd_tex->refine_damage = wxrd_view->damage_refine.enabled;
+
+  // client side shadows are neither uploaded nor allocated
+  struct wlr_box content;
+  wxrd_texture_set_crop (
+      wxrd_tex,
+      view_get_content_rect (wxrd_view, &content, false) ? &content : NULL);
+
+  uint64_t cost = wxrd_texture_latch_cost (wxrd_tex, back_gk, &damage);
+  bool take = wxrd_upload_scheduler_take (&server->upload_scheduler, cost);
+  if (!take) {
+    // keeps showing the previous texture, damage keeps accumulating
+    wxrd_view->upload_deferred_frames++;
+    wxrd_stats.uploads_deferred++;
+  } else {
+    wxrd_texture_latch_prepare (wxrd_tex, back_gk, &damage);
+  }
+
+  pixman_region32_fini (&damage);
+  return take;
+}
+
+static bool
+latch_view (struct wxrd_view *wxrd_view)
+{
+  struct wxrd_texture *wxrd_tex = view_get_wxrd_texture (wxrd_view);
+
+  // keeps showing the previous texture, damage keeps accumulating
+  if (wxrd_texture_importing (wxrd_tex)) {
+    return false;
+  }
+
+  pixman_region32_t damage;
+  pixman_region32_init (&damage);
+  GulkanTexture *back_gk = wxrd_buffer_age_back (
+      &wxrd_view->buffer_age, &wxrd_view->buffer_damage, &damage);
+  bool latched = wxrd_texture_latch (wxrd_tex, back_gk, &damage);
+  pixman_region32_fini (&damage);
+
+  if (!latched) {
+    wlr_log (WLR_ERROR, "skipping wxrd_view %p %s, gulkan texture == NULL",
+             wxrd_view, wxrd_view->title);
+    return false;
+  }
+  wxrd_buffer_age_latched (&wxrd_view->buffer_age,
+                           wxrd_view->server->xr_backend->renderer,
+                           wxrd_tex->gk, &wxrd_view->buffer_damage);
+  pixman_region32_clear (&wxrd_view->buffer_damage);
+  wxrd_view->upload_deferred_frames = 0;
+
+  if (wxrd_tex->import_latency_ns != 0) {
+    struct wlr_surface *surface = view_get_surface (wxrd_view);
+    pid_t pid;
+    wl_client_get_credentials (wl_resource_get_client (surface->resource),
+                               &pid, NULL, NULL);
+    wxrd_stats_client_import (pid, wxrd_tex->import_latency_ns);
+    wxrd_tex->import_latency_ns = 0;
+  }
+
+  if (wxrd_tex->refine_damaged_pixels != 0) {
+    wxrd_damage_refine_uploaded (&wxrd_view->damage_refine,
+                                 wxrd_tex->refine_damaged_pixels,
+                                 wxrd_tex->refine_changed_pixels);
+    wxrd_tex->refine_damaged_pixels = 0;
+    wxrd_tex->refine_changed_pixels = 0;
+  }
+
+  return true;
+}
+
 static void
 wxrd_submit_view_textures (struct wxrd_server *server)
 {
@@ -207,13 +446,37 @@ wxrd_submit_view_textures (struct wxrd_server *server)
 
   g_mutex_lock (&server->render_mutex);
 
-  struct timespec now;
-  clock_gettime (CLOCK_MONOTONIC, &now);
+  wxrd_renderer_retire_uploads (server->xr_backend->renderer);
 
-  struct wxrd_view *wxrd_view;
-  wl_list_for_each_reverse (wxrd_view, &server->views, link)
-  {
-    if (!validate_view (wxrd_view)) {
+  wxrd_upload_scheduler_frame_start (
+      &server->upload_scheduler,
+      wxrd_frame_clock_missed (&server->frame_clock));
+
+  // the cursor is small and moves with every hand motion, it goes first
+  wxrd_cursor_latch (&server->cursor);
+
+  // views that are looked at get their uploads first
+  int n_views = wl_list_length (&server->views);
+  struct wxrd_view **views
+      = calloc (n_views > 0 ? n_views : 1, sizeof (*views));
+  if (views == NULL) {
+    wlr_log (WLR_ERROR, "Failed to allocate views to latch");
+    n_views = 0;
+  } else {
+    n_views = wxrd_upload_scheduler_sort_views (server, views);
+  }
+
+  // CPU work of all uploads runs concurrently, GPU uploads stay here
+  int n_latched = 0;
+  for (int i = 0; i < n_views; i++) {
+    if (validate_view (views[i]) && prepare_view_latch (server, views[i])) {
+      views[n_latched++] = views[i];
+    }
+  }
+
+  for (int i = 0; i < n_latched; i++) {
+    struct wxrd_view *wxrd_view = views[i];
+    if (!latch_view (wxrd_view)) {
       continue;
     }
 
@@ -221,102 +484,60 @@ wxrd_submit_view_textures (struct wxrd_server *server)
     struct wlr_texture *tex = surface->buffer->texture;
     struct wxrd_texture *wxrd_tex = wxrd_get_texture (tex);
 
+    // the client may only draw into a buffer the GPU samples again once
+    // no frame in flight shows it anymore
+    if (wxrd_tex->buffer != wxrd_view->shown_buffer) {
+      wxrd_renderer_hold_buffer (server->xr_backend->renderer,
+                                 wxrd_view->shown_buffer);
+      wxrd_view->shown_buffer = wxrd_texture_lock_sampled_buffer (wxrd_tex);
+    }
+
     if (xrd_window_get_texture (wxrd_view->window) != wxrd_tex->gk) {
       // TODO is this the right condition?
-      bool has_rect = false;
-      struct XrdWindowRect rect;
-
-
-      if (wxrd_view->type == WXRD_VIEW_XDG_SHELL) {
-        struct wxrd_xdg_shell_view *shell_view
-            = xdg_shell_view_from_view (wxrd_view);
-        has_rect
-            = shell_view->xdg_surface->role == WLR_XDG_SURFACE_ROLE_TOPLEVEL;
-
-#if 0
-        struct wlr_fbox src_box;
-        wlr_surface_get_buffer_source_box(surface, &src_box);
-
-        wlr_log (WLR_DEBUG, "source box %f,%f %fx%f", src_box.x, src_box.y, src_box.width, src_box.height);
-
-        struct wlr_fbox buffer_source_box;
-        wlr_surface_get_buffer_source_box(surface, &buffer_source_box);
-        wlr_log (WLR_DEBUG, "buffer source box %f,%f %fx%f", buffer_source_box.x, buffer_source_box.y, buffer_source_box.width, buffer_source_box.height);
-        wlr_log (WLR_DEBUG, "buffer position %d,%d", surface->sx, surface->sy);
-
-#if 0
-        struct wlr_subsurface *subsurface;
-        wl_list_for_each (subsurface, &surface->subsurfaces_below, parent_link)
-        {
-          wlr_log (WLR_DEBUG, "subsurface %dx%d below at %d,%d", subsurface->surface->current.width, subsurface->surface->current.height, subsurface->current.x, subsurface->current.y);
-        }
-        wl_list_for_each (subsurface, &surface->subsurfaces_above, parent_link)
-        {
-          wlr_log (WLR_DEBUG, "subsurface %dx%d above at %d,%d", subsurface->surface->current.width, subsurface->surface->current.height, subsurface->current.x, subsurface->current.y);
-        }
-#endif
-#endif
-
-        struct wlr_box geometry;
-        wlr_xdg_surface_get_geometry (shell_view->xdg_surface, &geometry);
-
-        struct wlr_box *wlr_rect = &geometry;
-
-        // HACK (weston-simple-damage)
-        if (wlr_rect->width == 0 && wlr_rect->height == 0) {
-          wlr_log (WLR_ERROR,
-                   "geometry wlr_rect is all zero, not using geometry");
-          has_rect = false;
-        }
-
-        rect.bl.x = wlr_rect->x;
-        rect.bl.y = wlr_rect->y;
-        rect.tr.x = wlr_rect->x + wlr_rect->width;
-        rect.tr.y = wlr_rect->y + wlr_rect->height;
-
-        // if the client set geometry, it is probably on this surface.
-        // if the client did not set geometry, it defaults to a bounding box
-        // around all subsurfaces. either way, if the geometry is bigger than
-        // the texture, we don't use it.
-        // TODO: more advanced subsurface handling?
-        if (geometry.x < 0 || geometry.y < 0
-            || geometry.x + geometry.width
-                   > (int)surface->buffer->texture->width
-            || geometry.y + geometry.height
-                   > (int)surface->buffer->texture->height) {
-          has_rect = false;
-          wlr_log (
-              WLR_ERROR,
-              "geometry wlr_rect is bigger than texture, not using geometry");
-        }
+      // a cropped texture holds only the content rect already
+      struct wlr_box content = { 0 };
+      bool has_rect = !wxrd_texture_is_cropped (wxrd_tex)
+                      && view_get_content_rect (wxrd_view, &content, true);
+      struct XrdWindowRect rect = {
+        .bl = { .x = content.x, .y = content.y },
+        .tr = { .x = content.x + content.width,
+                .y = content.y + content.height },
+      };
+
+      // pointer positions on the window are relative to the texture
+      wxrd_view->texture_offset_x = wxrd_tex->crop.x;
+      wxrd_view->texture_offset_y = wxrd_tex->crop.y;
 
 #if 0
-        wlr_log (WLR_DEBUG,
-                 "submit %dx%d tex %p gk %p buf %p [%zu] %s using %dx%d rect "
-                 "at %d,%d: %dx%d->%dx%d",
-                 tex->width, tex->height, (void *)wxrd_tex,
-                 (void *)wxrd_tex->gk, wxrd_tex->buffer,
-                 wxrd_tex->buffer ? wxrd_tex->buffer->n_locks : 0,
-                 has_rect ? "" : "NOT", wlr_rect->width, wlr_rect->height,
-                 wlr_rect->x, wlr_rect->y, rect.bl.x, rect.bl.y, rect.tr.x,
-                 rect.tr.y);
+      wlr_log (WLR_DEBUG,
+               "submit %dx%d tex %p gk %p buf %p [%zu] %s using %dx%d rect "
+               "at %d,%d: %dx%d->%dx%d",
+               tex->width, tex->height, (void *)wxrd_tex,
+               (void *)wxrd_tex->gk, wxrd_tex->buffer,
+               wxrd_tex->buffer ? wxrd_tex->buffer->n_locks : 0,
+               has_rect ? "" : "NOT", content.width, content.height,
+               content.x, content.y, rect.bl.x, rect.bl.y, rect.tr.x,
+               rect.tr.y);
 #endif
-      }
 
-      // HACK: if we submit a new texture, xrdesktop will unref the old
-      // texture. But we need to keep the old texture around until the view is
-      // destroyed, therefore, ref the old texture.
+      // xrdesktop unrefs the previous texture when we submit a new one, but
+      // frames in flight may still sample it.
       GulkanTexture *prev_gk = xrd_window_get_texture (wxrd_view->window);
       if (prev_gk != NULL && prev_gk != wxrd_tex->gk) {
-        g_object_ref (prev_gk);
+        wxrd_renderer_hold_texture (server->xr_backend->renderer, prev_gk);
       }
+      // xrdesktop takes over a reference, wxrd_tex keeps its own
       xrd_window_set_and_submit_texture_with_rect (
-          wxrd_view->window, wxrd_tex->gk, has_rect ? &rect : NULL);
+          wxrd_view->window, g_object_ref (wxrd_tex->gk),
+          has_rect ? &rect : NULL);
     }
-
-    wxrd_view_for_each_surface (wxrd_view, send_frame_done_iterator, &now);
   }
+  free (views);
 
+  // one submit for the uploads of all views
+  wxrd_renderer_flush_uploads (server->xr_backend->renderer);
+
+  wxrd_frame_scheduler_latched (server);
 
 #if 0
   static double last_f = 0;
@@ -329,12 +550,24 @@ wxrd_submit_view_textures (struct wxrd_server *server)
   g_mutex_unlock (&server->render_mutex);
 }
 
+void
+wxrd_output_schedule_frame (struct wxrd_output *output)
+{
+  output->needs_frame = true;
+  wlr_output_schedule_frame (output->output);
+}
+
 static void
 output_handle_frame (struct wl_listener *listener, void *data)
 {
   struct wxrd_output *output = wl_container_of (listener, output, frame);
-  struct wxrd_server *server = output->server;
-  struct wlr_renderer *renderer = server->xr_backend->renderer;
+
+  // Nothing is mirrored to the desktop window, committing would only
+  // allocate and present a buffer no one looks at.
+  if (!output->needs_frame) {
+    return;
+  }
+  output->needs_frame = false;
 
   if (!wlr_output_attach_render (output->output, NULL)) {
     return;
@@ -352,10 +585,19 @@ output_handle_destroy (struct wl_listener *listener, void *data)
 {
   struct wxrd_output *output = wl_container_of (listener, output, destroy);
   wl_list_remove (&output->frame.link);
+  wl_list_remove (&output->mode.link);
   wl_list_remove (&output->destroy.link);
   free (output);
 }
 
+static void
+output_handle_mode (struct wl_listener *listener, void *data)
+{
+  struct wxrd_output *output = wl_container_of (listener, output, mode);
+  // e.g. the nested window was resized, it needs a buffer of the new size
+  wxrd_output_schedule_frame (output);
+}
+
 static void
 handle_new_output (struct wl_listener *listener, void *data)
 {
@@ -363,20 +605,35 @@ handle_new_output (struct wl_listener *listener, void *data)
   struct wxrd_server *server = wl_container_of (listener, server, new_output);
   struct wlr_output *wlr_output = data;
 
-  /* Configures the output created by the backend to use our allocator
-   * and our renderer. Must be done once, before commiting the output */
-  wlr_output_init_render (wlr_output, server->allocator,
-                          server->xr_backend->renderer);
-
   struct wxrd_output *output = calloc (1, sizeof (*output));
   output->output = wlr_output;
   output->server = server;
 
-  output->frame.notify = output_handle_frame;
-  wl_signal_add (&wlr_output->events.frame, &output->frame);
   output->destroy.notify = output_handle_destroy;
   wl_signal_add (&wlr_output->events.destroy, &output->destroy);
 
+  if (wlr_output_is_headless (wlr_output)) {
+    // The headless output is never shown. Without a renderer no swapchain
+    // is allocated for it. Its frame timer still fires, but nothing listens
+    // to the frame events, rendering is driven by the XR frames.
+    wl_list_init (&output->frame.link);
+    wl_list_init (&output->mode.link);
+  } else {
+    /* Configures the output created by the backend to use our allocator
+     * and our renderer. Must be done once, before commiting the output */
+    wlr_output_init_render (wlr_output, server->allocator,
+                            server->xr_backend->renderer);
+
+    output->frame.notify = output_handle_frame;
+    wl_signal_add (&wlr_output->events.frame, &output->frame);
+    output->mode.notify = output_handle_mode;
+    wl_signal_add (&wlr_output->events.mode, &output->mode);
+
+    // the nested window has to be committed once to show up and receive
+    // keyboard input
+    output->needs_frame = true;
+  }
+
   if (wlr_output_is_wl (wlr_output)
       && server->remote_pointer_constraints != NULL) {
     wlr_log (WLR_ERROR, "unimplemented: pointer constraints");
@@ -388,8 +645,9 @@ handle_new_output (struct wl_listener *listener, void *data)
   }
 
   wlr_log (WLR_INFO, "New Output with refresh %d", output->output->refresh);
-  wlr_output_set_custom_mode (output->output, 1000, 1000, 144000);
-  // output->output->refresh = 144000;
+  wlr_output_set_custom_mode (output->output, server->output_mode.width,
+                              server->output_mode.height,
+                              server->output_mode.refresh_mhz);
 }
 
 static void
@@ -463,12 +721,64 @@ MessageCallback (GLenum source,
            severity, message);
 }
 
+/* Without XR frame starts fifo clients would never get past a barrier and
+ * each of their commits would be held back forever, so fifo barriers and
+ * timed commits are latched at the last known refresh rate instead. */
+static void
+schedule_suspended_latch (struct wxrd_server *server)
+{
+  int64_t delay_ms = server->frame_clock.period_ns / 1000000;
+  wl_event_source_timer_update (server->suspended_latch_timer,
+                                delay_ms > 0 ? delay_ms : 1);
+}
+
+static int
+handle_suspended_latch (void *data)
+{
+  struct wxrd_server *server = data;
+  if (server->rendering) {
+    return 0;
+  }
+
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  int64_t now_ns = timespec_to_nsec (&now);
+
+  g_mutex_lock (&server->render_mutex);
+  wxrd_fifo_latch (server);
+  wxrd_commit_timing_latch (server, now_ns);
+  g_mutex_unlock (&server->render_mutex);
+
+  schedule_suspended_latch (server);
+  return 0;
+}
+
 static void
 _render_cb (XrdShell *xrd_shell,
             G3kRenderEvent *event,
             struct wxrd_server *server)
 {
   if (event->type == G3K_RENDER_EVENT_FRAME_START) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    int64_t now_ns = timespec_to_nsec (&now);
+    wxrd_frame_clock_tick (&server->frame_clock, now_ns);
+    update_output_refresh (server);
+    wxrd_stats_report (now_ns);
+
+    // the frame starting now is presented roughly one period later
+    int64_t present_ns = now_ns + server->frame_clock.period_ns;
+
+    // apply commits that were held back for this frame before latching
+    g_mutex_lock (&server->render_mutex);
+    // pick up commits that arrived since the last main loop dispatch
+    wl_display_flush_clients (server->wl_display);
+    wl_event_loop_dispatch (wl_display_get_event_loop (server->wl_display),
+                            0);
+    wxrd_fifo_latch (server);
+    wxrd_commit_timing_latch (server, present_ns);
+    g_mutex_unlock (&server->render_mutex);
+
     // TODO: do we need renderer begin/end?
     // wlr_renderer_begin (server->xr_backend->renderer, 0, 0);
 
@@ -554,10 +864,10 @@ _move_cursor_cb (XrdShell *xrd_shell,
     wlr_log (WLR_ERROR, "no surface for focused window");
     return;
   }
-  wlr_seat_pointer_notify_enter (server->seat, surface, event->position->x,
-                                 event->position->y);
-  wlr_seat_pointer_notify_motion (server->seat, get_now (), event->position->x,
-                                  event->position->y);
+  double sx = event->position->x + xrd_focus->texture_offset_x;
+  double sy = event->position->y + xrd_focus->texture_offset_y;
+  wlr_seat_pointer_notify_enter (server->seat, surface, sx, sy);
+  wlr_seat_pointer_notify_motion (server->seat, get_now (), sx, sy);
   wlr_seat_pointer_notify_frame (server->seat);
 }
 
@@ -580,6 +890,7 @@ _state_change_cb (XrdShell *xrd_shell,
   case GXR_STATE_SHUTDOWN:
     server->framecycle = FALSE;
     server->rendering = FALSE;
+    schedule_suspended_latch (server);
     // TODO shut down
     wlr_log (WLR_DEBUG, "Shutting down...");
     break;
@@ -587,10 +898,16 @@ _state_change_cb (XrdShell *xrd_shell,
   case GXR_STATE_FRAMECYCLE_STOP: server->framecycle = FALSE; break;
   case GXR_STATE_RENDERING_START:
     server->rendering = TRUE;
+    // deferred buffers are caught up with one upload on the next frame
+    wxrd_renderer_set_suspended (server->xr_backend->renderer, false);
     wlr_log (WLR_DEBUG, "Start rendering...");
     break;
   case GXR_STATE_RENDERING_STOP:
-    server->rendering = TRUE;
+    // Frame callbacks are withheld while not rendering, so clients stop
+    // drawing. Whatever they still commit is only uploaded on resume.
+    server->rendering = FALSE;
+    wxrd_renderer_set_suspended (server->xr_backend->renderer, true);
+    schedule_suspended_latch (server);
     wlr_log (WLR_DEBUG, "Stop rendering...");
     break;
   }
@@ -616,12 +933,15 @@ main (int argc, char *argv[])
   wlr_log_init (WLR_DEBUG, NULL);
 
   const char *startup_cmd = NULL;
+  int max_render_time = 0;
   int opt;
-  while ((opt = getopt (argc, argv, "s:h")) != -1) {
+  while ((opt = getopt (argc, argv, "s:r:h")) != -1) {
     switch (opt) {
     case 's': startup_cmd = optarg; break;
+    case 'r': max_render_time = atoi (optarg); break;
     default:
-      fprintf (stderr, "usage: %s [-s startup-cmd]\n", argv[0]);
+      fprintf (stderr, "usage: %s [-s startup-cmd] [-r max-render-time-ms]\n",
+               argv[0]);
       return 1;
     }
   }
@@ -645,6 +965,15 @@ main (int argc, char *argv[])
   }
 
   g_mutex_init (&server.render_mutex);
+  wxrd_frame_clock_init (&server.frame_clock);
+  wxrd_upload_scheduler_init (&server.upload_scheduler);
+  wxrd_frame_scheduler_init (&server, max_render_time);
+  init_output_mode (&server);
+  // nothing renders until the runtime says so
+  server.suspended_latch_timer = wl_event_loop_add_timer (
+      wl_display_get_event_loop (server.wl_display), handle_suspended_latch,
+      &server);
+  schedule_suspended_latch (&server);
 
   bool is_nested = false;
   if (getenv ("DISPLAY") != NULL || getenv ("WAYLAND_DISPLAY") != NULL) {
@@ -726,6 +1055,11 @@ main (int argc, char *argv[])
 
   wlr_renderer_init_wl_display (wxrd_renderer, server.wl_display);
 
+  // before any client can create a shm pool
+  if (wxrd_udmabuf_init (&server.udmabuf, server.wl_display)) {
+    wxrd_renderer_set_udmabuf (wxrd_renderer, &server.udmabuf);
+  }
+
   struct wlr_compositor *compositor
       = wlr_compositor_create (server.wl_display, wxrd_renderer);
 
@@ -738,6 +1072,9 @@ main (int argc, char *argv[])
   wl_list_init (&server.views);
   wxrd_xdg_shell_init (&server);
 
+  wxrd_fifo_init (&server);
+  wxrd_commit_timing_init (&server);
+
   const char *wl_socket = wl_display_add_socket_auto (server.wl_display);
   if (wl_socket == NULL) {
     wlr_log (WLR_ERROR, "wl_display_add_socket_auto failed");
@@ -751,23 +1088,23 @@ main (int argc, char *argv[])
     return 1;
   }
 
-  wl_global_create (server.wl_display, &wl_output_interface, 3, NULL,
+  wl_global_create (server.wl_display, &wl_output_interface, 3, &server,
                     output_bind);
 
   if (headless_mode) {
     server.headless.output = wlr_headless_add_output (headless_backend, 1, 1);
 
-    int w = 800;
-    int h = 600;
-    int refresh = 60;
     wlr_output_enable (server.headless.output, true);
-    wlr_output_set_custom_mode (server.headless.output, w, h, refresh * 1000);
+    wlr_output_set_custom_mode (
+        server.headless.output, server.output_mode.width,
+        server.output_mode.height, server.output_mode.refresh_mhz);
     if (!wlr_output_commit (server.headless.output)) {
       wlr_log (WLR_ERROR, "Failed to commit noop output");
       return false;
     }
 
-    wlr_output_create_global (server.headless.output);
+    // no wlr_output_create_global: clients only see the wxrd wl_output
+    // global that advertises the XR mode
 
 
     // Create a stub wlr_keyboard only used to set the keymap
@@ -824,8 +1161,11 @@ main (int argc, char *argv[])
 
     g_mutex_lock (&server.render_mutex);
 
+    // while suspended there are no frames to hit, wake up less often
+    int timeout = server.rendering ? 1 : SUSPENDED_DISPATCH_TIMEOUT_MS;
+
     wl_display_flush_clients (server.wl_display);
-    int ret = wl_event_loop_dispatch (wl_event_loop, 1);
+    int ret = wl_event_loop_dispatch (wl_event_loop, timeout);
     if (ret < 0) {
       wlr_log (WLR_ERROR, "wl_event_loop_dispatch failed");
       return 1;
@@ -858,9 +1198,13 @@ main (int argc, char *argv[])
   disconnect_cb_sources (server.xr_backend);
   g_object_unref (server.xr_backend->xrd_shell);
 
+  wxrd_frame_scheduler_finish (&server);
+  wl_event_source_remove (server.suspended_latch_timer);
   wl_event_source_remove (signals[0]);
   wl_event_source_remove (signals[1]);
   wl_display_destroy_clients (server.wl_display);
+  wxrd_renderer_set_udmabuf (server.xr_backend->renderer, NULL);
+  wxrd_udmabuf_finish (&server.udmabuf);
 
   // wl_display_destroy (server.wl_display);
 
@@ -11,13 +11,22 @@
 
 #include <wayland-server-core.h>
 
+#include <stdbool.h>
+
 struct wxrd_output
 {
   struct wlr_output *output;
   struct wxrd_server *server;
 
+  // the output is only committed when there is something to show
+  bool needs_frame;
+
   struct wl_listener frame;
+  struct wl_listener mode;
   struct wl_listener destroy;
 };
 
+void
+wxrd_output_schedule_frame (struct wxrd_output *output);
+
 #endif
@@ -14,9 +14,13 @@
 #include <wlr/render/wlr_texture.h>
 #include <wlr/types/wlr_compositor.h>
 #include <wlr/types/wlr_xcursor_manager.h>
+#include <wlr/types/wlr_xdg_decoration_v1.h>
 #include <wlr/types/wlr_xdg_shell.h>
 
 #include "xwayland.h"
+#include "frame-clock.h"
+#include "udmabuf.h"
+#include "upload-scheduler.h"
 
 struct wxrd_xr_backend;
 
@@ -46,6 +50,7 @@ struct wxrd_server
   struct wlr_input_device vr_keyboard_device;
 
   struct wlr_xdg_shell *xdg_shell;
+  struct wlr_xdg_decoration_manager_v1 *xdg_decoration_manager;
 
   struct wl_seat *remote_seat;
   struct wl_pointer *remote_pointer;
@@ -60,6 +65,27 @@ struct wxrd_server
   bool rendering;
   bool framecycle;
 
+  struct wxrd_frame_clock frame_clock;
+  struct wxrd_upload_scheduler upload_scheduler;
+
+  // mode advertised through the wl_output global
+  struct
+  {
+    int width;
+    int height;
+    int refresh_mhz;
+    // consecutive frames the measured refresh differed from refresh_mhz
+    int mismatch_frames;
+  } output_mode;
+  struct wl_list output_resources; // wl_resource_get_link
+
+  struct wl_list fifos;         // wxrd_fifo.link
+  struct wl_list commit_timers; // wxrd_commit_timer.link
+  // latches fifo barriers and timed commits while there are no XR frames
+  struct wl_event_source *suspended_latch_timer;
+
+  struct wxrd_udmabuf udmabuf;
+
   enum wxrd_seatop seatop;
   struct
   {
@@ -79,6 +105,7 @@ struct wxrd_server
   struct wl_listener new_input;
   struct wl_listener new_output;
   struct wl_listener new_xdg_surface;
+  struct wl_listener new_xdg_decoration;
   struct wl_listener new_xr_surface;
   struct wl_listener request_set_cursor;
   struct wl_listener request_set_selection;
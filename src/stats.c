@@ -0,0 +1,149 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <string.h>
+#include <wlr/util/log.h>
+
+#include "stats.h"
+
+#define WXRD_STATS_INTERVAL_NS (5 * 1000000000ll)
+
+struct wxrd_stats wxrd_stats = { 0 };
+
+static void
+reset_interval (int64_t now_ns)
+{
+  wxrd_stats.interval_start_ns = now_ns;
+  wxrd_stats.frames = 0;
+  wxrd_stats.refresh_mismatch_frames = 0;
+  wxrd_stats.frames_hit = 0;
+  wxrd_stats.frames_missed = 0;
+  wxrd_stats.buffers_latched = 0;
+  wxrd_stats.buffers_superseded = 0;
+  wxrd_stats.buffers_host_imported = 0;
+  wxrd_stats.buffers_uploaded = 0;
+  wxrd_stats.buffers_imported = 0;
+  wxrd_stats.buffers_udmabuf = 0;
+  wxrd_stats.dmabuf_cache_hits = 0;
+  wxrd_stats.dmabuf_cache_misses = 0;
+  wxrd_stats.upload_ns = 0;
+  wxrd_stats.import_ns = 0;
+  wxrd_stats.upload_bytes = 0;
+  wxrd_stats.damage_pixels_committed = 0;
+  wxrd_stats.damage_pixels_uploaded = 0;
+  wxrd_stats.damage_rects = 0;
+  wxrd_stats.damage_uploads = 0;
+  wxrd_stats.uploads_deferred = 0;
+  wxrd_stats.texture_allocations = 0;
+  wxrd_stats.textures_recycled = 0;
+  memset (wxrd_stats.clients, 0, sizeof (wxrd_stats.clients));
+}
+
+void
+wxrd_stats_client_import (pid_t pid, int64_t latency_ns)
+{
+  struct wxrd_client_stats *client = NULL;
+  for (int i = 0; i < WXRD_STATS_MAX_CLIENTS; i++) {
+    if (wxrd_stats.clients[i].pid == pid
+        || wxrd_stats.clients[i].pid == 0) {
+      client = &wxrd_stats.clients[i];
+      break;
+    }
+  }
+  // more clients importing than slots, they are not worth tracking then
+  if (client == NULL) {
+    return;
+  }
+
+  client->pid = pid;
+  client->imports++;
+  client->import_latency_ns += latency_ns;
+  if (latency_ns > client->max_import_latency_ns) {
+    client->max_import_latency_ns = latency_ns;
+  }
+}
+
+void
+wxrd_stats_report (int64_t now_ns)
+{
+  wxrd_stats.frames++;
+
+  if (wxrd_stats.interval_start_ns == 0) {
+    reset_interval (now_ns);
+    return;
+  }
+
+  if (now_ns - wxrd_stats.interval_start_ns < WXRD_STATS_INTERVAL_NS) {
+    return;
+  }
+
+  wlr_log (WLR_DEBUG,
+           "stats: %lu frames, refresh advertised %d mHz measured %d mHz, "
+           "%lu mismatched frames, client commits %lu in time %lu late",
+           wxrd_stats.frames, wxrd_stats.advertised_refresh_mhz,
+           wxrd_stats.measured_refresh_mhz,
+           wxrd_stats.refresh_mismatch_frames, wxrd_stats.frames_hit,
+           wxrd_stats.frames_missed);
+  wlr_log (WLR_DEBUG,
+           "stats: %lu client buffers latched (%lu zero copy), %lu superseded",
+           wxrd_stats.buffers_latched, wxrd_stats.buffers_host_imported,
+           wxrd_stats.buffers_superseded);
+
+  // what a shm buffer costs when uploaded vs. imported through udmabuf
+  double upload_us = wxrd_stats.buffers_uploaded > 0
+                         ? wxrd_stats.upload_ns / 1000.0
+                               / wxrd_stats.buffers_uploaded
+                         : 0;
+  double import_us = wxrd_stats.buffers_imported > 0
+                         ? wxrd_stats.import_ns / 1000.0
+                               / wxrd_stats.buffers_imported
+                         : 0;
+  wlr_log (WLR_DEBUG,
+           "stats: %.1f us/upload, %lu dmabufs imported (%lu udmabuf) "
+           "%.1f us/import, dmabuf cache %lu hits %lu misses",
+           upload_us, wxrd_stats.buffers_imported, wxrd_stats.buffers_udmabuf,
+           import_us, wxrd_stats.dmabuf_cache_hits,
+           wxrd_stats.dmabuf_cache_misses);
+
+  // how much damage was saved by coalescing commits before uploading
+  double pixel_ratio = wxrd_stats.damage_pixels_uploaded > 0
+                           ? (double)wxrd_stats.damage_pixels_committed
+                                 / wxrd_stats.damage_pixels_uploaded
+                           : 0;
+  double rect_ratio = wxrd_stats.damage_uploads > 0
+                          ? (double)wxrd_stats.damage_rects
+                                / wxrd_stats.damage_uploads
+                          : 0;
+  wlr_log (WLR_DEBUG,
+           "stats: uploaded %lu bytes/frame, damage coalescing pixels "
+           "%.2f:1 rects %.2f:1",
+           wxrd_stats.upload_bytes / wxrd_stats.frames, pixel_ratio,
+           rect_ratio);
+  wlr_log (WLR_DEBUG, "stats: upload budget %lu KiB/frame, %lu deferred",
+           wxrd_stats.upload_budget_bytes / 1024, wxrd_stats.uploads_deferred);
+  wlr_log (WLR_DEBUG,
+           "stats: %lu texture allocations, %lu recycled, %lu alive, "
+           "%lu KiB idle in pool, %lu retiring",
+           wxrd_stats.texture_allocations, wxrd_stats.textures_recycled,
+           wxrd_stats.textures_live, wxrd_stats.texture_pool_idle_bytes / 1024,
+           wxrd_stats.textures_retiring);
+
+  for (int i = 0; i < WXRD_STATS_MAX_CLIENTS; i++) {
+    const struct wxrd_client_stats *client = &wxrd_stats.clients[i];
+    if (client->imports == 0) {
+      continue;
+    }
+    wlr_log (WLR_DEBUG,
+             "stats: client %d: %lu dmabuf imports, latency %.2f ms avg "
+             "%.2f ms max",
+             client->pid, client->imports,
+             client->import_latency_ns / 1000000.0 / client->imports,
+             client->max_import_latency_ns / 1000000.0);
+  }
+
+  reset_interval (now_ns);
+}
@@ -0,0 +1,100 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef WXRD_STATS_H
+#define WXRD_STATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// clients whose dmabuf import latency is tracked per interval
+#define WXRD_STATS_MAX_CLIENTS 8
+
+struct wxrd_client_stats
+{
+  pid_t pid; // 0 if the slot is free
+  uint64_t imports;
+  // commit to import done
+  int64_t import_latency_ns;
+  int64_t max_import_latency_ns;
+};
+
+/* Counters that are logged and reset every WXRD_STATS_INTERVAL_NS by
+ * wxrd_stats_report. */
+struct wxrd_stats
+{
+  int64_t interval_start_ns;
+
+  uint64_t frames;
+
+  // refresh advertised through wl_output vs. measured XR refresh
+  int32_t advertised_refresh_mhz;
+  int32_t measured_refresh_mhz;
+  uint64_t refresh_mismatch_frames;
+
+  // client commits that made / missed the latch after a frame callback
+  uint64_t frames_hit;
+  uint64_t frames_missed;
+
+  // client buffers uploaded / imported at the latch, and released unused
+  // because a newer buffer was committed before the latch
+  uint64_t buffers_latched;
+  uint64_t buffers_superseded;
+  // latched shm buffers the GPU copied from without a CPU copy
+  uint64_t buffers_host_imported;
+  // latched shm buffers uploaded, dmabufs imported, and shm buffers
+  // converted to dmabufs with udmabuf among the latter
+  uint64_t buffers_uploaded;
+  uint64_t buffers_imported;
+  uint64_t buffers_udmabuf;
+
+  // dmabuf buffers whose import was found in the dmabuf cache, or not
+  uint64_t dmabuf_cache_hits;
+  uint64_t dmabuf_cache_misses;
+
+  // CPU time spent on shm uploads and dmabuf imports
+  int64_t upload_ns;
+  int64_t import_ns;
+
+  // bytes sent to the GPU for shm buffers
+  uint64_t upload_bytes;
+  // damaged pixels as committed by clients, and as uploaded after
+  // accumulating and simplifying the damage of several commits
+  uint64_t damage_pixels_committed;
+  uint64_t damage_pixels_uploaded;
+  // damage rects committed by clients, and partial uploads done for them
+  uint64_t damage_rects;
+  uint64_t damage_uploads;
+  // gulkan textures (one device memory allocation each) created for shm
+  // buffers, and textures handed out again by the texture pool instead
+  uint64_t texture_allocations;
+  uint64_t textures_recycled;
+  // not reset: texture pool allocations alive, bytes of them idle, and
+  // released textures waiting for the XR frames that may sample them
+  uint64_t textures_live;
+  uint64_t texture_pool_idle_bytes;
+  uint64_t textures_retiring;
+
+  // view uploads postponed to a later frame by the upload budget
+  uint64_t uploads_deferred;
+  uint64_t upload_budget_bytes;
+
+  struct wxrd_client_stats clients[WXRD_STATS_MAX_CLIENTS];
+};
+
+extern struct wxrd_stats wxrd_stats;
+
+/* Accounts a dmabuf import of a client's buffer that finished latency_ns
+ * after the commit. */
+void
+wxrd_stats_client_import (pid_t pid, int64_t latency_ns);
+
+/* Called once per XR frame. */
+void
+wxrd_stats_report (int64_t now_ns);
+
+#endif
@@ -0,0 +1,235 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <string.h>
+#include <wlr/util/log.h>
+
+#include "stats.h"
+#include "texture-pool.h"
+
+// textures up to this size are recycled, e.g. cursors and tooltips
+#define SMALL_TEXTURE_MAX_TEXELS (256 * 256)
+// bytes of released textures kept for reuse
+#define MAX_IDLE_BYTES (16 * 1024 * 1024)
+// spreads bursts, e.g. a client closing many windows, over several frames
+#define MAX_RETIRE_PER_FRAME 16
+
+// marks textures created by the pool
+static const char *pool_key = "wxrd-texture-pool";
+
+static uint64_t
+texture_bytes (VkExtent2D extent)
+{
+  // all shm formats are 32 bit
+  return (uint64_t)extent.width * extent.height * 4;
+}
+
+/* Textures may outlive the pool in xrdesktop, so the count is global. */
+static void
+texture_finalized (gpointer data, GObject *texture)
+{
+  wxrd_stats.textures_live--;
+}
+
+void
+wxrd_texture_pool_init (struct wxrd_texture_pool *pool, GulkanClient *client)
+{
+  pool->client = client;
+  wl_array_init (&pool->idle);
+  pool->idle_bytes = 0;
+  wl_array_init (&pool->retiring);
+  pool->frame = 0;
+}
+
+void
+wxrd_texture_pool_finish (struct wxrd_texture_pool *pool)
+{
+  // nothing renders anymore
+  struct wxrd_texture_pool_retiring *retiring;
+  wl_array_for_each (retiring, &pool->retiring)
+  {
+    if (retiring->texture != NULL) {
+      g_object_unref (retiring->texture);
+    }
+    if (retiring->buffer != NULL) {
+      wlr_buffer_unlock (retiring->buffer);
+    }
+  }
+  wl_array_release (&pool->retiring);
+  wxrd_stats.textures_retiring = 0;
+
+  struct wxrd_texture_pool_entry *entry;
+  wl_array_for_each (entry, &pool->idle)
+  {
+    g_object_unref (entry->texture);
+  }
+  wl_array_release (&pool->idle);
+  pool->idle_bytes = 0;
+  wxrd_stats.texture_pool_idle_bytes = 0;
+}
+
+static void
+remove_idle (struct wxrd_texture_pool *pool, size_t index)
+{
+  struct wxrd_texture_pool_entry *entries = pool->idle.data;
+  size_t n = pool->idle.size / sizeof (*entries);
+
+  pool->idle_bytes -= texture_bytes (entries[index].extent);
+  wxrd_stats.texture_pool_idle_bytes = pool->idle_bytes;
+  memmove (&entries[index], &entries[index + 1],
+           (n - index - 1) * sizeof (*entries));
+  pool->idle.size -= sizeof (*entries);
+}
+
+GulkanTexture *
+wxrd_texture_pool_get (struct wxrd_texture_pool *pool,
+                       VkExtent2D extent,
+                       VkFormat format)
+{
+  struct wxrd_texture_pool_entry *entries = pool->idle.data;
+  size_t n = pool->idle.size / sizeof (*entries);
+
+  // newest first, likely the cursor image that was just replaced
+  for (size_t i = n; i-- > 0;) {
+    if (entries[i].extent.width == extent.width
+        && entries[i].extent.height == extent.height
+        && entries[i].format == format) {
+      GulkanTexture *texture = entries[i].texture;
+      remove_idle (pool, i);
+      wxrd_stats.textures_recycled++;
+      return texture;
+    }
+  }
+
+  GulkanTexture *texture = gulkan_texture_new (pool->client, extent, format);
+  if (texture == NULL) {
+    return NULL;
+  }
+  g_object_set_data (G_OBJECT (texture), pool_key, pool);
+  g_object_weak_ref (G_OBJECT (texture), texture_finalized, NULL);
+
+  wxrd_stats.texture_allocations++;
+  wxrd_stats.textures_live++;
+  return texture;
+}
+
+/* Drops a retired reference, keeping the texture for reuse if possible */
+static void
+texture_put (struct wxrd_texture_pool *pool, GulkanTexture *texture)
+{
+  if (!wxrd_texture_pool_owns (pool, texture)) {
+    g_object_unref (texture);
+    return;
+  }
+
+  // Other references are xrdesktop showing it, other wxrd_textures sharing
+  // it, or transfers in flight. Only recycle what nobody can still use.
+  bool last_ref = G_OBJECT (texture)->ref_count == 1;
+
+  VkExtent2D extent = gulkan_texture_get_extent (texture);
+  uint64_t bytes = texture_bytes (extent);
+
+  if (!last_ref || extent.width * extent.height > SMALL_TEXTURE_MAX_TEXELS
+      || bytes > MAX_IDLE_BYTES) {
+    g_object_unref (texture);
+    return;
+  }
+
+  // evict the oldest
+  while (pool->idle_bytes + bytes > MAX_IDLE_BYTES) {
+    struct wxrd_texture_pool_entry *oldest = pool->idle.data;
+    GulkanTexture *evicted = oldest->texture;
+    remove_idle (pool, 0);
+    g_object_unref (evicted);
+  }
+
+  struct wxrd_texture_pool_entry *entry
+      = wl_array_add (&pool->idle, sizeof (*entry));
+  if (entry == NULL) {
+    g_object_unref (texture);
+    return;
+  }
+  entry->texture = texture;
+  entry->extent = extent;
+  entry->format = gulkan_texture_get_format (texture);
+  pool->idle_bytes += bytes;
+  wxrd_stats.texture_pool_idle_bytes = pool->idle_bytes;
+}
+
+bool
+wxrd_texture_pool_owns (struct wxrd_texture_pool *pool, GulkanTexture *texture)
+{
+  return g_object_get_data (G_OBJECT (texture), pool_key) == pool;
+}
+
+void
+wxrd_texture_pool_release (struct wxrd_texture_pool *pool,
+                           GulkanTexture *texture)
+{
+  struct wxrd_texture_pool_retiring *retiring
+      = wl_array_add (&pool->retiring, sizeof (*retiring));
+  if (retiring == NULL) {
+    wlr_log (WLR_ERROR, "Allocation failed, leaking texture");
+    return;
+  }
+  retiring->texture = texture;
+  retiring->buffer = NULL;
+  retiring->frame = pool->frame;
+  wxrd_stats.textures_retiring++;
+}
+
+void
+wxrd_texture_pool_release_buffer (struct wxrd_texture_pool *pool,
+                                  struct wlr_buffer *buffer)
+{
+  struct wxrd_texture_pool_retiring *retiring
+      = wl_array_add (&pool->retiring, sizeof (*retiring));
+  if (retiring == NULL) {
+    // the client may draw into what frames in flight show, but can go on
+    wlr_log (WLR_ERROR, "Allocation failed, releasing buffer");
+    wlr_buffer_unlock (buffer);
+    return;
+  }
+  retiring->texture = NULL;
+  retiring->buffer = buffer;
+  retiring->frame = pool->frame;
+}
+
+void
+wxrd_texture_pool_frame_start (struct wxrd_texture_pool *pool)
+{
+  pool->frame++;
+
+  struct wxrd_texture_pool_retiring *retiring = pool->retiring.data;
+  size_t n = pool->retiring.size / sizeof (*retiring);
+  size_t n_retired = 0;
+  while (n_retired < n && n_retired < MAX_RETIRE_PER_FRAME
+         && retiring[n_retired].frame + WXRD_TEXTURE_RETIRE_FRAMES
+                <= pool->frame) {
+    n_retired++;
+  }
+  if (n_retired == 0) {
+    return;
+  }
+
+  // copy first, putting textures and unlocking buffers may unref them
+  struct wxrd_texture_pool_retiring retired[MAX_RETIRE_PER_FRAME];
+  memcpy (retired, retiring, n_retired * sizeof (*retiring));
+  memmove (retiring, retiring + n_retired,
+           (n - n_retired) * sizeof (*retiring));
+  pool->retiring.size -= n_retired * sizeof (*retiring);
+
+  for (size_t i = 0; i < n_retired; i++) {
+    if (retired[i].texture != NULL) {
+      wxrd_stats.textures_retiring--;
+      texture_put (pool, retired[i].texture);
+    }
+    if (retired[i].buffer != NULL) {
+      wlr_buffer_unlock (retired[i].buffer);
+    }
+  }
+}
@@ -0,0 +1,92 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef WXRD_TEXTURE_POOL_H
+#define WXRD_TEXTURE_POOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-util.h>
+#include <wlr/types/wlr_buffer.h>
+
+#include <xrd.h>
+
+// XR runtimes render up to two frames ahead of the frame start event, a
+// texture that stopped being shown may be sampled for this many frames
+#define WXRD_TEXTURE_RETIRE_FRAMES 3
+
+/* Creates the gulkan textures for shm buffers. gulkan allocates device
+ * memory for every texture and can't bind images to memory of ours, so
+ * small textures (cursors, popups, tooltips) are recycled instead of
+ * suballocated: released ones are kept and handed out again for the next
+ * texture of the same size and format. */
+struct wxrd_texture_pool
+{
+  GulkanClient *client;
+
+  struct wl_array idle; // struct wxrd_texture_pool_entry, oldest first
+  uint64_t idle_bytes;
+
+  // released textures and client buffers the XR frames in flight may still
+  // sample
+  struct wl_array retiring; // struct wxrd_texture_pool_retiring, oldest first
+  uint64_t frame;
+};
+
+struct wxrd_texture_pool_retiring
+{
+  GulkanTexture *texture; // NULL for a buffer
+  struct wlr_buffer *buffer; // locked, NULL for a texture
+  // pool frame the texture was released in
+  uint64_t frame;
+};
+
+struct wxrd_texture_pool_entry
+{
+  GulkanTexture *texture;
+  VkExtent2D extent;
+  VkFormat format;
+};
+
+void
+wxrd_texture_pool_init (struct wxrd_texture_pool *pool, GulkanClient *client);
+
+void
+wxrd_texture_pool_finish (struct wxrd_texture_pool *pool);
+
+/* Returns a texture with undefined contents, NULL on failure. */
+GulkanTexture *
+wxrd_texture_pool_get (struct wxrd_texture_pool *pool,
+                       VkExtent2D extent,
+                       VkFormat format);
+
+/* Takes over a reference to any gulkan texture and drops it once the XR
+ * frames that may have sampled the texture completed. Textures from
+ * wxrd_texture_pool_get are then kept for reuse if they are small and
+ * nobody else holds a reference. */
+void
+wxrd_texture_pool_release (struct wxrd_texture_pool *pool,
+                           GulkanTexture *texture);
+
+/* Takes over a lock of a client buffer whose memory an imported texture
+ * samples, and releases it to the client once the XR frames that may have
+ * sampled the texture completed. */
+void
+wxrd_texture_pool_release_buffer (struct wxrd_texture_pool *pool,
+                                  struct wlr_buffer *buffer);
+
+/* Retires textures released a few frames ago. Called once per XR frame. */
+void
+wxrd_texture_pool_frame_start (struct wxrd_texture_pool *pool);
+
+/* Whether texture was created by the pool, i.e. holds no client memory and
+ * may be written to. */
+bool
+wxrd_texture_pool_owns (struct wxrd_texture_pool *pool,
+                        GulkanTexture *texture);
+
+#endif
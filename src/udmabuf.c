@@ -0,0 +1,339 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+#include <drm_fourcc.h>
+#include <fcntl.h>
+#include <linux/udmabuf.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <wlr/util/log.h>
+
+#include "udmabuf.h"
+
+// wl_shm request opcodes
+#define WL_SHM_CREATE_POOL 0
+#define WL_SHM_POOL_CREATE_BUFFER 0
+#define WL_SHM_POOL_DESTROY 1
+#define WL_SHM_POOL_RESIZE 2
+#define WL_BUFFER_DESTROY 0
+
+static uint32_t
+drm_format_from_wl_shm (uint32_t wl_shm_format)
+{
+  switch (wl_shm_format) {
+  case WL_SHM_FORMAT_ARGB8888: return DRM_FORMAT_ARGB8888;
+  case WL_SHM_FORMAT_XRGB8888: return DRM_FORMAT_XRGB8888;
+  default: return wl_shm_format;
+  }
+}
+
+/* udmabuf needs a memfd that can't shrink, the pages are pinned */
+static int
+pool_create_dmabuf (struct wxrd_udmabuf *udmabuf, int memfd, int32_t size)
+{
+  int seals = fcntl (memfd, F_GET_SEALS);
+  if (seals < 0 || !(seals & F_SEAL_SHRINK) || (seals & F_SEAL_WRITE)) {
+    return -1;
+  }
+
+  long page_size = sysconf (_SC_PAGESIZE);
+  struct udmabuf_create create = {
+    .memfd = (uint32_t)memfd,
+    .flags = UDMABUF_FLAGS_CLOEXEC,
+    .offset = 0,
+    .size = (uint64_t)size & ~(uint64_t)(page_size - 1),
+  };
+  if (create.size == 0) {
+    return -1;
+  }
+
+  return ioctl (udmabuf->dev_fd, UDMABUF_CREATE, &create);
+}
+
+static void
+pool_destroy (struct wxrd_udmabuf_pool *pool)
+{
+  close (pool->memfd);
+  if (pool->dmabuf_fd >= 0) {
+    close (pool->dmabuf_fd);
+  }
+  wl_list_remove (&pool->link);
+  free (pool);
+}
+
+static void
+buffer_destroy (struct wxrd_udmabuf_buffer *buffer)
+{
+  if (buffer->dmabuf_fd >= 0) {
+    close (buffer->dmabuf_fd);
+  }
+  wl_list_remove (&buffer->link);
+  free (buffer);
+}
+
+static void
+client_destroy (struct wxrd_udmabuf_client *client)
+{
+  struct wxrd_udmabuf_pool *pool, *tmp_pool;
+  wl_list_for_each_safe (pool, tmp_pool, &client->pools, link)
+  {
+    pool_destroy (pool);
+  }
+  struct wxrd_udmabuf_buffer *buffer, *tmp_buffer;
+  wl_list_for_each_safe (buffer, tmp_buffer, &client->buffers, link)
+  {
+    buffer_destroy (buffer);
+  }
+  wl_list_remove (&client->destroy.link);
+  wl_list_remove (&client->link);
+  free (client);
+}
+
+static void
+handle_client_destroy (struct wl_listener *listener, void *data)
+{
+  struct wxrd_udmabuf_client *client
+      = wl_container_of (listener, client, destroy);
+  client_destroy (client);
+}
+
+static struct wxrd_udmabuf_client *
+get_client (struct wxrd_udmabuf *udmabuf, struct wl_client *wl_client)
+{
+  struct wxrd_udmabuf_client *client;
+  wl_list_for_each (client, &udmabuf->clients, link)
+  {
+    if (client->client == wl_client) {
+      return client;
+    }
+  }
+
+  client = calloc (1, sizeof (struct wxrd_udmabuf_client));
+  if (client == NULL) {
+    return NULL;
+  }
+  client->client = wl_client;
+  wl_list_init (&client->pools);
+  wl_list_init (&client->buffers);
+  client->destroy.notify = handle_client_destroy;
+  wl_client_add_destroy_listener (wl_client, &client->destroy);
+  wl_list_insert (&udmabuf->clients, &client->link);
+  return client;
+}
+
+static struct wxrd_udmabuf_pool *
+find_pool (struct wxrd_udmabuf_client *client, uint32_t id)
+{
+  struct wxrd_udmabuf_pool *pool;
+  wl_list_for_each (pool, &client->pools, link)
+  {
+    if (pool->id == id) {
+      return pool;
+    }
+  }
+  return NULL;
+}
+
+static void
+handle_create_pool (struct wxrd_udmabuf *udmabuf,
+                    struct wl_client *wl_client,
+                    const union wl_argument *args)
+{
+  struct wxrd_udmabuf_client *client = get_client (udmabuf, wl_client);
+  if (client == NULL) {
+    return;
+  }
+
+  struct wxrd_udmabuf_pool *pool = calloc (1, sizeof (struct wxrd_udmabuf_pool));
+  if (pool == NULL) {
+    return;
+  }
+
+  // the request still owns the fd, libwayland closes it after mapping
+  pool->id = args[0].n;
+  pool->memfd = fcntl (args[1].h, F_DUPFD_CLOEXEC, 0);
+  pool->size = args[2].i;
+  if (pool->memfd < 0) {
+    free (pool);
+    return;
+  }
+  pool->dmabuf_fd = pool_create_dmabuf (udmabuf, pool->memfd, pool->size);
+
+  wl_list_insert (&client->pools, &pool->link);
+}
+
+static void
+handle_pool_request (struct wxrd_udmabuf *udmabuf,
+                     struct wl_client *wl_client,
+                     uint32_t pool_id,
+                     uint32_t opcode,
+                     const union wl_argument *args)
+{
+  struct wxrd_udmabuf_client *client = get_client (udmabuf, wl_client);
+  struct wxrd_udmabuf_pool *pool
+      = client != NULL ? find_pool (client, pool_id) : NULL;
+  if (pool == NULL) {
+    return;
+  }
+
+  switch (opcode) {
+  case WL_SHM_POOL_CREATE_BUFFER: {
+    if (pool->dmabuf_fd < 0) {
+      return;
+    }
+    struct wxrd_udmabuf_buffer *buffer
+        = calloc (1, sizeof (struct wxrd_udmabuf_buffer));
+    if (buffer == NULL) {
+      return;
+    }
+    buffer->id = args[0].n;
+    buffer->offset = args[1].i;
+    buffer->width = args[2].i;
+    buffer->height = args[3].i;
+    buffer->stride = args[4].i;
+    buffer->wl_shm_format = args[5].u;
+    // buffers outlive their pool object
+    buffer->dmabuf_fd = fcntl (pool->dmabuf_fd, F_DUPFD_CLOEXEC, 0);
+    wl_list_insert (&client->buffers, &buffer->link);
+    break;
+  }
+  case WL_SHM_POOL_RESIZE:
+    // the udmabuf can't grow with the pool, existing buffers keep theirs
+    if (pool->dmabuf_fd >= 0) {
+      close (pool->dmabuf_fd);
+    }
+    pool->size = args[0].i;
+    pool->dmabuf_fd = pool_create_dmabuf (udmabuf, pool->memfd, pool->size);
+    break;
+  case WL_SHM_POOL_DESTROY: pool_destroy (pool); break;
+  }
+}
+
+static void
+handle_buffer_destroy (struct wxrd_udmabuf *udmabuf,
+                       struct wl_client *wl_client,
+                       uint32_t buffer_id)
+{
+  struct wxrd_udmabuf_client *client;
+  wl_list_for_each (client, &udmabuf->clients, link)
+  {
+    if (client->client != wl_client) {
+      continue;
+    }
+    struct wxrd_udmabuf_buffer *buffer;
+    wl_list_for_each (buffer, &client->buffers, link)
+    {
+      if (buffer->id == buffer_id) {
+        buffer_destroy (buffer);
+        return;
+      }
+    }
+  }
+}
+
+static void
+protocol_logger (void *user_data,
+                 enum wl_protocol_logger_type direction,
+                 const struct wl_protocol_logger_message *message)
+{
+  struct wxrd_udmabuf *udmabuf = user_data;
+
+  if (direction != WL_PROTOCOL_LOGGER_REQUEST) {
+    return;
+  }
+
+  const char *class = wl_resource_get_class (message->resource);
+  struct wl_client *client = wl_resource_get_client (message->resource);
+  int opcode = message->message_opcode;
+
+  if (strcmp (class, "wl_shm") == 0 && opcode == WL_SHM_CREATE_POOL) {
+    handle_create_pool (udmabuf, client, message->arguments);
+  } else if (strcmp (class, "wl_shm_pool") == 0) {
+    handle_pool_request (udmabuf, client, wl_resource_get_id (message->resource),
+                         opcode, message->arguments);
+  } else if (strcmp (class, "wl_buffer") == 0 && opcode == WL_BUFFER_DESTROY) {
+    handle_buffer_destroy (udmabuf, client,
+                           wl_resource_get_id (message->resource));
+  }
+}
+
+bool
+wxrd_udmabuf_init (struct wxrd_udmabuf *udmabuf, struct wl_display *display)
+{
+  wl_list_init (&udmabuf->clients);
+  udmabuf->logger = NULL;
+
+  udmabuf->dev_fd = open ("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+  if (udmabuf->dev_fd < 0) {
+    wlr_log (WLR_INFO, "/dev/udmabuf not available, uploading all shm buffers");
+    return false;
+  }
+
+  udmabuf->logger
+      = wl_display_add_protocol_logger (display, protocol_logger, udmabuf);
+  return true;
+}
+
+void
+wxrd_udmabuf_finish (struct wxrd_udmabuf *udmabuf)
+{
+  struct wxrd_udmabuf_client *client, *tmp;
+  wl_list_for_each_safe (client, tmp, &udmabuf->clients, link)
+  {
+    client_destroy (client);
+  }
+  if (udmabuf->logger != NULL) {
+    wl_protocol_logger_destroy (udmabuf->logger);
+  }
+  if (udmabuf->dev_fd >= 0) {
+    close (udmabuf->dev_fd);
+  }
+}
+
+bool
+wxrd_udmabuf_get_attribs (struct wxrd_udmabuf *udmabuf,
+                          const void *data,
+                          struct wlr_dmabuf_attributes *attribs)
+{
+  struct wxrd_udmabuf_client *client;
+  wl_list_for_each (client, &udmabuf->clients, link)
+  {
+    struct wxrd_udmabuf_buffer *buffer;
+    wl_list_for_each (buffer, &client->buffers, link)
+    {
+      // the pixels of the wl_buffer tell which of our buffers it is
+      struct wl_resource *resource
+          = wl_client_get_object (client->client, buffer->id);
+      struct wl_shm_buffer *shm_buffer
+          = resource != NULL ? wl_shm_buffer_get (resource) : NULL;
+      if (shm_buffer == NULL || wl_shm_buffer_get_data (shm_buffer) != data) {
+        continue;
+      }
+
+      int fd = fcntl (buffer->dmabuf_fd, F_DUPFD_CLOEXEC, 0);
+      if (fd < 0) {
+        return false;
+      }
+
+      *attribs = (struct wlr_dmabuf_attributes){
+        .width = buffer->width,
+        .height = buffer->height,
+        .format = drm_format_from_wl_shm (buffer->wl_shm_format),
+        .modifier = DRM_FORMAT_MOD_LINEAR,
+        .n_planes = 1,
+        .offset = { (uint32_t)buffer->offset },
+        .stride = { (uint32_t)buffer->stride },
+        .fd = { fd, -1, -1, -1 },
+      };
+      return true;
+    }
+  }
+  return false;
+}
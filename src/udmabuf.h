@@ -0,0 +1,68 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef WXRD_UDMABUF_H
+#define WXRD_UDMABUF_H
+
+#include <stdbool.h>
+#include <wayland-server.h>
+#include <wlr/render/dmabuf.h>
+
+/* libwayland does not expose shm pool fds. They are taken from the
+ * wl_shm.create_pool requests with a protocol logger, sealed memfd pools
+ * are turned into dmabufs with /dev/udmabuf. */
+struct wxrd_udmabuf
+{
+  int dev_fd; // /dev/udmabuf, -1 if not available
+  struct wl_protocol_logger *logger;
+
+  struct wl_list clients; // wxrd_udmabuf_client.link
+};
+
+struct wxrd_udmabuf_client
+{
+  struct wl_client *client;
+  struct wl_listener destroy;
+
+  struct wl_list pools;   // wxrd_udmabuf_pool.link
+  struct wl_list buffers; // wxrd_udmabuf_buffer.link
+
+  struct wl_list link;
+};
+
+struct wxrd_udmabuf_pool
+{
+  uint32_t id; // wl_shm_pool object id
+  int memfd;   // dup of the client's pool fd
+  int32_t size;
+  int dmabuf_fd; // udmabuf of the whole pool, -1 if not convertible
+  struct wl_list link;
+};
+
+struct wxrd_udmabuf_buffer
+{
+  uint32_t id; // wl_buffer object id
+  int dmabuf_fd;
+  int32_t offset, width, height, stride;
+  uint32_t wl_shm_format;
+  struct wl_list link;
+};
+
+bool
+wxrd_udmabuf_init (struct wxrd_udmabuf *udmabuf, struct wl_display *display);
+
+void
+wxrd_udmabuf_finish (struct wxrd_udmabuf *udmabuf);
+
+/* Finds the dmabuf of the shm buffer whose pixels are at data. The returned
+ * attribs use a dup'd fd owned by the caller. */
+bool
+wxrd_udmabuf_get_attribs (struct wxrd_udmabuf *udmabuf,
+                          const void *data,
+                          struct wlr_dmabuf_attributes *attribs);
+
+#endif
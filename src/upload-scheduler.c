@@ -0,0 +1,144 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdlib.h>
+#include <wlr/util/log.h>
+
+#include "backend.h"
+#include "server.h"
+#include "stats.h"
+#include "upload-scheduler.h"
+#include "view.h"
+
+#define MIB (1024ull * 1024ull)
+
+#define DEFAULT_BUDGET_BYTES (32 * MIB)
+#define MIN_BUDGET_BYTES (2 * MIB)
+#define MAX_BUDGET_BYTES (256 * MIB)
+
+// upload order, higher first
+#define PRIORITY_FOCUSED 2
+#define PRIORITY_HOVERED 1
+#define PRIORITY_BACKGROUND 0
+// XR frames after which waiting beats priority, so a view that fills the
+// budget every frame, e.g. a focused video, can't starve the others
+#define MAX_DEFERRED_FRAMES 4
+
+void
+wxrd_upload_scheduler_init (struct wxrd_upload_scheduler *scheduler)
+{
+  scheduler->budget_bytes = DEFAULT_BUDGET_BYTES;
+  scheduler->min_budget_bytes = MIN_BUDGET_BYTES;
+  scheduler->max_budget_bytes = MAX_BUDGET_BYTES;
+  scheduler->adaptive = true;
+  scheduler->used_bytes = 0;
+  scheduler->uploads = 0;
+
+  const char *budget_env = getenv ("WXRD_UPLOAD_BUDGET_KB");
+  if (budget_env != NULL) {
+    uint64_t budget = strtoull (budget_env, NULL, 10) * 1024;
+    if (budget > 0) {
+      scheduler->budget_bytes = budget;
+      scheduler->adaptive = false;
+    }
+  }
+
+  wlr_log (WLR_DEBUG, "Upload budget %lu KiB per frame%s",
+           scheduler->budget_bytes / 1024,
+           scheduler->adaptive ? ", adaptive" : "");
+}
+
+void
+wxrd_upload_scheduler_frame_start (struct wxrd_upload_scheduler *scheduler,
+                                   bool missed)
+{
+  // Only blame our uploads for a miss if we spent a good part of the budget.
+  // Back off fast on misses, grow slowly again while frames are hit.
+  if (scheduler->adaptive) {
+    if (missed && scheduler->used_bytes > scheduler->budget_bytes / 2) {
+      scheduler->budget_bytes /= 2;
+    } else if (!missed) {
+      scheduler->budget_bytes += scheduler->budget_bytes / 32;
+    }
+
+    if (scheduler->budget_bytes < scheduler->min_budget_bytes) {
+      scheduler->budget_bytes = scheduler->min_budget_bytes;
+    } else if (scheduler->budget_bytes > scheduler->max_budget_bytes) {
+      scheduler->budget_bytes = scheduler->max_budget_bytes;
+    }
+  }
+
+  scheduler->used_bytes = 0;
+  scheduler->uploads = 0;
+  wxrd_stats.upload_budget_bytes = scheduler->budget_bytes;
+}
+
+bool
+wxrd_upload_scheduler_take (struct wxrd_upload_scheduler *scheduler,
+                            uint64_t bytes)
+{
+  if (bytes == 0) {
+    return true;
+  }
+
+  if (scheduler->uploads > 0
+      && scheduler->used_bytes + bytes > scheduler->budget_bytes) {
+    return false;
+  }
+
+  scheduler->used_bytes += bytes;
+  scheduler->uploads++;
+  return true;
+}
+
+static int
+compare_views (const void *a, const void *b)
+{
+  const struct wxrd_view *view_a = *(struct wxrd_view *const *)a;
+  const struct wxrd_view *view_b = *(struct wxrd_view *const *)b;
+
+  bool starved_a = view_a->upload_deferred_frames >= MAX_DEFERRED_FRAMES;
+  bool starved_b = view_b->upload_deferred_frames >= MAX_DEFERRED_FRAMES;
+  if (starved_a != starved_b) {
+    return starved_b - starved_a;
+  }
+  if (starved_a) {
+    return view_b->upload_deferred_frames - view_a->upload_deferred_frames;
+  }
+
+  if (view_a->upload_priority != view_b->upload_priority) {
+    return view_b->upload_priority - view_a->upload_priority;
+  }
+  return view_b->upload_deferred_frames - view_a->upload_deferred_frames;
+}
+
+int
+wxrd_upload_scheduler_sort_views (struct wxrd_server *server,
+                                  struct wxrd_view **views)
+{
+  struct wxrd_view *focused = wxrd_get_focus (server);
+  XrdWindow *hovered
+      = xrd_shell_get_synth_hovered (server->xr_backend->xrd_shell);
+
+  int n = 0;
+  struct wxrd_view *view;
+  wl_list_for_each_reverse (view, &server->views, link)
+  {
+    if (view == focused) {
+      view->upload_priority = PRIORITY_FOCUSED;
+    } else if (view->window != NULL && view->window == hovered) {
+      view->upload_priority = PRIORITY_HOVERED;
+    } else {
+      view->upload_priority = PRIORITY_BACKGROUND;
+    }
+    views[n++] = view;
+  }
+
+  // stable order within a priority is not needed, waiting time decides
+  qsort (views, n, sizeof (struct wxrd_view *), compare_views);
+  return n;
+}
@@ -0,0 +1,56 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef WXRD_UPLOAD_SCHEDULER_H
+#define WXRD_UPLOAD_SCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct wxrd_server;
+struct wxrd_view;
+
+/* Limits the shm upload bytes per XR frame. Views that don't fit keep
+ * showing their previous texture and accumulate damage for a later frame. */
+struct wxrd_upload_scheduler
+{
+  uint64_t budget_bytes;
+  uint64_t min_budget_bytes;
+  uint64_t max_budget_bytes;
+  // budget is not adapted to frame misses when set by the user
+  bool adaptive;
+
+  // spent in the current frame
+  uint64_t used_bytes;
+  int uploads;
+};
+
+void
+wxrd_upload_scheduler_init (struct wxrd_upload_scheduler *scheduler);
+
+/* Resets the spent budget and adapts it to whether the last frame missed. */
+void
+wxrd_upload_scheduler_frame_start (struct wxrd_upload_scheduler *scheduler,
+                                   bool missed);
+
+/* Returns false if an upload of this size has to wait for a later frame.
+ * The first upload of a frame is always allowed, so every view eventually
+ * gets its update. */
+bool
+wxrd_upload_scheduler_take (struct wxrd_upload_scheduler *scheduler,
+                            uint64_t bytes);
+
+/* Fills views with the server's views in upload order: views that waited
+ * for several frames by how long they have been waiting, the focused view,
+ * the hovered view, then the others by how long they have been waiting.
+ * views must hold wl_list_length (&server->views) entries.
+ * Returns the number of views. */
+int
+wxrd_upload_scheduler_sort_views (struct wxrd_server *server,
+                                  struct wxrd_view **views);
+
+#endif
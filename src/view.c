@@ -9,10 +9,11 @@
 #include "view.h"
 #include "server.h"
 #include "backend.h"
+#include "frame-scheduler.h"
+#include "stats.h"
+#include "wxrd-renderer.h"
 #include <wlr/util/log.h>
 
-#define WXRD_SURFACE_SCALE 200.0
-
 void
 wxrd_view_init (struct wxrd_view *view,
                 struct wxrd_server *server,
@@ -22,8 +23,50 @@ wxrd_view_init (struct wxrd_view *view,
   view->type = type;
   view->server = server;
   view->impl = impl;
+  // until the client agrees to leave them to us
+  view->client_side_decorations = true;
 
   wl_list_insert (server->views.prev, &view->link);
+  wl_list_init (&view->surface_commit.link);
+  pixman_region32_init (&view->buffer_damage);
+  wxrd_buffer_age_init (&view->buffer_age);
+}
+
+void
+wxrd_view_set_client_side_decorations (struct wxrd_view *view, bool csd)
+{
+  if (view->client_side_decorations == csd) {
+    return;
+  }
+  view->client_side_decorations = csd;
+  wlr_log (WLR_DEBUG, "view %s: %s side decorations", view->title,
+           csd ? "client" : "server");
+}
+
+static void
+handle_surface_commit (struct wl_listener *listener, void *data)
+{
+  struct wxrd_view *view = wl_container_of (listener, view, surface_commit);
+  struct wlr_surface *surface = data;
+
+  // intermediate buffers are never uploaded, their damage is
+  pixman_region32_union (&view->buffer_damage, &view->buffer_damage,
+                         &surface->buffer_damage);
+
+  int n_rects;
+  const pixman_box32_t *rects
+      = pixman_region32_rectangles (&surface->buffer_damage, &n_rects);
+  for (int i = 0; i < n_rects; i++) {
+    wxrd_stats.damage_pixels_committed
+        += (uint64_t)(rects[i].x2 - rects[i].x1) * (rects[i].y2 - rects[i].y1);
+  }
+  wxrd_stats.damage_rects += n_rects;
+
+  wxrd_damage_refine_commit (&view->damage_refine, &surface->buffer_damage,
+                             surface->current.buffer_width,
+                             surface->current.buffer_height);
+
+  wxrd_frame_scheduler_view_commit (view);
 }
 
 void
@@ -38,6 +81,12 @@ wxrd_view_finish (struct wxrd_view *view)
   }
 
   free (view->title);
+  pixman_region32_fini (&view->buffer_damage);
+  wxrd_buffer_age_finish (&view->buffer_age,
+                          view->server->xr_backend->renderer);
+  wxrd_renderer_hold_buffer (view->server->xr_backend->renderer,
+                             view->shown_buffer);
+  view->shown_buffer = NULL;
 
   wl_list_remove (&view->link);
 }
@@ -190,7 +239,7 @@ view_map (struct wxrd_view *view)
       wlr_log (WLR_DEBUG, "is top level window");
       wxrd_set_focus (view);
 
-      graphene_point3d_t p = { 0, 1, -3.5 + z_offset };
+      graphene_point3d_t p = { 0, 1, -WXRD_WINDOW_DISTANCE + z_offset };
       graphene_matrix_t t;
       graphene_matrix_init_identity (&t);
       graphene_matrix_translate (&t, &p);
@@ -214,6 +263,12 @@ view_map (struct wxrd_view *view)
 
   view->window = win;
 
+  struct wlr_surface *surface = view_get_surface (view);
+  if (surface != NULL) {
+    view->surface_commit.notify = handle_surface_commit;
+    wl_signal_add (&surface->events.commit, &view->surface_commit);
+  }
+
   xrd_shell_add_window (view->server->xr_backend->xrd_shell, view->window,
                         view->parent == NULL, view);
 
@@ -226,6 +281,19 @@ view_unmap (struct wxrd_view *view)
   wlr_log (WLR_DEBUG, "unmap view %p", (void *)view);
   view->mapped = false;
 
+  wl_list_remove (&view->surface_commit.link);
+  wl_list_init (&view->surface_commit.link);
+  view->frame_pending = false;
+  pixman_region32_clear (&view->buffer_damage);
+  wxrd_buffer_age_reset (&view->buffer_age,
+                         view->server->xr_backend->renderer);
+  wxrd_renderer_hold_buffer (view->server->xr_backend->renderer,
+                             view->shown_buffer);
+  view->shown_buffer = NULL;
+
+  wlr_log (WLR_DEBUG, "view %s: %lu commits made the XR frame latch, %lu missed",
+           view->title, view->frames_hit, view->frames_missed);
+
   struct wxrd_view *wview;
   wl_list_for_each (wview, &view->server->views, link)
   {
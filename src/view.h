@@ -18,6 +18,14 @@
 
 #include <xrd.h>
 
+#include "buffer-age.h"
+#include "damage-refine.h"
+
+// pixels per meter of XR windows
+#define WXRD_SURFACE_SCALE 200.0
+// distance of newly mapped top level windows from the origin in meter
+#define WXRD_WINDOW_DISTANCE 3.5
+
 enum wxrd_view_type
 {
   WXRD_VIEW_XDG_SHELL,
@@ -100,6 +108,35 @@ struct wxrd_view
 
   struct wl_list link;
 
+  // listens to the surface while mapped
+  struct wl_listener surface_commit;
+
+  // buffer damage of commits since the last XR frame latch
+  pixman_region32_t buffer_damage;
+  // set by wxrd_upload_scheduler_sort_views
+  int upload_priority;
+  // XR frames the upload waited for budget
+  int upload_deferred_frames;
+  // whether shm damage is refined with tile diffs
+  struct wxrd_damage_refine damage_refine;
+  // the textures shm buffers are uploaded into
+  struct wxrd_buffer_age buffer_age;
+  // locked client buffer the shown texture samples, NULL if it is a copy
+  struct wlr_buffer *shown_buffer;
+  // the client draws title bar, borders and shadows into its buffers
+  bool client_side_decorations;
+  // buffer position of the shown texture, if it was cropped
+  int texture_offset_x;
+  int texture_offset_y;
+
+  // a frame callback was sent, waiting for the next commit
+  bool frame_pending;
+  int64_t frame_done_ns;
+  int latches_since_frame_done;
+  // commits that made / missed the XR frame latch after a frame callback
+  uint64_t frames_hit;
+  uint64_t frames_missed;
+
   enum wxrd_view_type type;
   struct
   {
@@ -146,6 +183,13 @@ wxrd_view_begin_move (struct wxrd_view *view);
 void
 wxrd_view_close (struct wxrd_view *view);
 
+/* Records whether the client decorates the view itself. wxrd asks every
+ * client to leave decorations to the server and draws none: xrdesktop moves
+ * and resizes windows with the controllers, so they are shown undecorated in
+ * XR. */
+void
+wxrd_view_set_client_side_decorations (struct wxrd_view *view, bool csd);
+
 /* Sets to zero if surface is not two dimensional */
 /* TODO: 3D resize? */
 void
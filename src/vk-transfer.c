@@ -0,0 +1,1060 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <unistd.h>
+#include <wlr/util/log.h>
+
+#include "frame-clock.h"
+#include "vk-transfer.h"
+
+// damage of a frame that doesn't fit is uploaded through gulkan instead
+#define STAGING_RING_SIZE (32 * 1024 * 1024)
+// device local heaps up to this size are only the legacy BAR window
+#define REBAR_MIN_HEAP_SIZE (256 * 1024 * 1024)
+// rects of the upload benchmark: small damage, and a window update to
+// compare staging ring placements
+#define BENCHMARK_RECT_SIZE 32
+#define BENCHMARK_LARGE_RECT_SIZE 256
+#define BENCHMARK_ITERATIONS 200
+
+static void
+host_import_unref (struct wxrd_vk_host_import *import)
+{
+  if (--import->ref_count > 0) {
+    return;
+  }
+  vkDestroyBuffer (import->transfer->device, import->buffer, NULL);
+  vkFreeMemory (import->transfer->device, import->memory, NULL);
+  free (import);
+}
+
+/* Drops the cache's reference, batches in flight keep theirs */
+static void
+host_import_uncache (struct wxrd_vk_host_import *import)
+{
+  wl_list_remove (&import->buffer_destroy.link);
+  wl_list_remove (&import->link);
+  import->wlr_buffer = NULL;
+  host_import_unref (import);
+}
+
+static void
+host_import_handle_buffer_destroy (struct wl_listener *listener, void *data)
+{
+  struct wxrd_vk_host_import *import
+      = wl_container_of (listener, import, buffer_destroy);
+  host_import_uncache (import);
+}
+
+static void
+batch_release (struct wxrd_vk_transfer *transfer, struct wxrd_vk_batch *batch)
+{
+  GulkanTexture **texture;
+  wl_array_for_each (texture, &batch->textures)
+  {
+    g_object_unref (*texture);
+  }
+  struct wlr_buffer **wlr_buffer;
+  wl_array_for_each (wlr_buffer, &batch->wlr_buffers)
+  {
+    wlr_buffer_unlock (*wlr_buffer);
+  }
+  struct wxrd_vk_host_import **import;
+  wl_array_for_each (import, &batch->host_imports)
+  {
+    host_import_unref (*import);
+  }
+  batch->textures.size = 0;
+  batch->wlr_buffers.size = 0;
+  batch->host_imports.size = 0;
+
+  vkResetCommandBuffer (batch->cmd_buffer, 0);
+  vkResetFences (transfer->device, 1, &batch->fence);
+
+  wl_list_remove (&batch->link);
+  wl_list_insert (&transfer->free_batches, &batch->link);
+}
+
+static void
+batch_destroy (struct wxrd_vk_transfer *transfer, struct wxrd_vk_batch *batch)
+{
+  vkFreeCommandBuffers (transfer->device, transfer->command_pool, 1,
+                        &batch->cmd_buffer);
+  vkDestroyFence (transfer->device, batch->fence, NULL);
+  wl_array_release (&batch->textures);
+  wl_array_release (&batch->wlr_buffers);
+  wl_array_release (&batch->host_imports);
+  wl_list_remove (&batch->link);
+  free (batch);
+}
+
+static struct wxrd_vk_batch *
+batch_create (struct wxrd_vk_transfer *transfer)
+{
+  struct wxrd_vk_batch *batch = calloc (1, sizeof (struct wxrd_vk_batch));
+  if (batch == NULL) {
+    return NULL;
+  }
+
+  VkCommandBufferAllocateInfo cmd_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+    .commandPool = transfer->command_pool,
+    .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+    .commandBufferCount = 1,
+  };
+  VkFenceCreateInfo fence_info = {
+    .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+  };
+  if (vkAllocateCommandBuffers (transfer->device, &cmd_info,
+                                &batch->cmd_buffer)
+          != VK_SUCCESS
+      || vkCreateFence (transfer->device, &fence_info, NULL, &batch->fence)
+             != VK_SUCCESS) {
+    wlr_log (WLR_ERROR, "Failed to create transfer command buffer");
+    if (batch->cmd_buffer != VK_NULL_HANDLE) {
+      vkFreeCommandBuffers (transfer->device, transfer->command_pool, 1,
+                            &batch->cmd_buffer);
+    }
+    free (batch);
+    return NULL;
+  }
+
+  wl_array_init (&batch->textures);
+  wl_array_init (&batch->wlr_buffers);
+  wl_array_init (&batch->host_imports);
+  wl_list_init (&batch->link);
+  return batch;
+}
+
+/* Returns the batch of this frame, starting it if needed */
+static struct wxrd_vk_batch *
+get_recording_batch (struct wxrd_vk_transfer *transfer)
+{
+  if (transfer->recording != NULL) {
+    return transfer->recording;
+  }
+
+  struct wxrd_vk_batch *batch;
+  if (!wl_list_empty (&transfer->free_batches)) {
+    batch = wl_container_of (transfer->free_batches.next, batch, link);
+    wl_list_remove (&batch->link);
+    wl_list_init (&batch->link);
+  } else {
+    batch = batch_create (transfer);
+    if (batch == NULL) {
+      return NULL;
+    }
+  }
+
+  VkCommandBufferBeginInfo begin_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+  };
+  vkBeginCommandBuffer (batch->cmd_buffer, &begin_info);
+  batch->staging_end = transfer->staging_head;
+
+  transfer->recording = batch;
+  return batch;
+}
+
+/* Returns the first memory type with all of flags and none of excluded */
+static int32_t
+find_memory_type (struct wxrd_vk_transfer *transfer,
+                  uint32_t type_bits,
+                  VkMemoryPropertyFlags flags,
+                  VkMemoryPropertyFlags excluded)
+{
+  VkPhysicalDeviceMemoryProperties props;
+  vkGetPhysicalDeviceMemoryProperties (transfer->physical_device, &props);
+  for (uint32_t i = 0; i < props.memoryTypeCount; i++) {
+    VkMemoryPropertyFlags type_flags = props.memoryTypes[i].propertyFlags;
+    if ((type_bits & (1u << i)) && (type_flags & flags) == flags
+        && (type_flags & excluded) == 0) {
+      return (int32_t)i;
+    }
+  }
+  return -1;
+}
+
+/* Whether a device local heap is host visible beyond the legacy 256 MiB
+ * BAR window, i.e. resizable BAR is enabled. */
+static bool
+has_rebar (struct wxrd_vk_transfer *transfer)
+{
+  VkMemoryPropertyFlags flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+                                | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                                | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+  VkPhysicalDeviceMemoryProperties props;
+  vkGetPhysicalDeviceMemoryProperties (transfer->physical_device, &props);
+  for (uint32_t i = 0; i < props.memoryTypeCount; i++) {
+    const VkMemoryType *type = &props.memoryTypes[i];
+    if ((type->propertyFlags & flags) == flags
+        && props.memoryHeaps[type->heapIndex].size > REBAR_MIN_HEAP_SIZE) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* device_local: place the ring in VRAM the CPU writes to through the BAR,
+ * so the GPU copies from VRAM instead of over PCIe. */
+static bool
+staging_init (struct wxrd_vk_transfer *transfer,
+              VkDeviceSize size,
+              bool device_local)
+{
+  VkBufferCreateInfo buffer_info = {
+    .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+    .size = size,
+    .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+  };
+  if (vkCreateBuffer (transfer->device, &buffer_info, NULL,
+                      &transfer->staging)
+      != VK_SUCCESS) {
+    return false;
+  }
+
+  VkMemoryRequirements reqs;
+  vkGetBufferMemoryRequirements (transfer->device, transfer->staging, &reqs);
+  VkMemoryPropertyFlags flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                                | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  int32_t type;
+  if (device_local) {
+    type = find_memory_type (transfer, reqs.memoryTypeBits,
+                             flags | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0);
+  } else {
+    // with ReBAR the first host visible type may be VRAM
+    type = find_memory_type (transfer, reqs.memoryTypeBits, flags,
+                             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    if (type < 0) {
+      type = find_memory_type (transfer, reqs.memoryTypeBits, flags, 0);
+    }
+  }
+
+  VkMemoryAllocateInfo alloc_info = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+    .allocationSize = reqs.size,
+    .memoryTypeIndex = (uint32_t)type,
+  };
+  if (type < 0
+      || vkAllocateMemory (transfer->device, &alloc_info, NULL,
+                           &transfer->staging_memory)
+             != VK_SUCCESS) {
+    vkDestroyBuffer (transfer->device, transfer->staging, NULL);
+    transfer->staging = VK_NULL_HANDLE;
+    return false;
+  }
+
+  vkBindBufferMemory (transfer->device, transfer->staging,
+                      transfer->staging_memory, 0);
+  if (vkMapMemory (transfer->device, transfer->staging_memory, 0,
+                   VK_WHOLE_SIZE, 0, (void **)&transfer->staging_map)
+      != VK_SUCCESS) {
+    vkFreeMemory (transfer->device, transfer->staging_memory, NULL);
+    vkDestroyBuffer (transfer->device, transfer->staging, NULL);
+    transfer->staging = VK_NULL_HANDLE;
+    return false;
+  }
+
+  transfer->staging_size = size;
+  transfer->staging_head = 0;
+  transfer->staging_tail = 0;
+  transfer->staging_device_local = device_local;
+  return true;
+}
+
+static void
+staging_finish (struct wxrd_vk_transfer *transfer)
+{
+  if (transfer->staging == VK_NULL_HANDLE) {
+    return;
+  }
+  vkUnmapMemory (transfer->device, transfer->staging_memory);
+  vkFreeMemory (transfer->device, transfer->staging_memory, NULL);
+  vkDestroyBuffer (transfer->device, transfer->staging, NULL);
+  transfer->staging = VK_NULL_HANDLE;
+}
+
+bool
+wxrd_vk_device_has_extension (VkPhysicalDevice physical_device,
+                              const char *name)
+{
+  uint32_t n = 0;
+  VkResult res
+      = vkEnumerateDeviceExtensionProperties (physical_device, NULL, &n, NULL);
+  if (res != VK_SUCCESS || n == 0) {
+    return false;
+  }
+
+  VkExtensionProperties *props = calloc (n, sizeof (*props));
+  if (props == NULL) {
+    return false;
+  }
+
+  bool found = false;
+  res = vkEnumerateDeviceExtensionProperties (physical_device, NULL, &n,
+                                              props);
+  for (uint32_t i = 0; res == VK_SUCCESS && i < n && !found; i++) {
+    found = strcmp (props[i].extensionName, name) == 0;
+  }
+  free (props);
+  return found;
+}
+
+bool
+wxrd_vk_transfer_init (struct wxrd_vk_transfer *transfer,
+                       GulkanClient *client)
+{
+  GulkanDevice *device = gulkan_client_get_device (client);
+
+  transfer->device = gulkan_client_get_device_handle (client);
+  transfer->physical_device = gulkan_client_get_physical_device_handle (client);
+  // xrdesktop samples the textures on the graphics queue. Copies recorded
+  // there are ordered against its frames by submission order and the image
+  // barriers alone, without semaphores or queue family ownership transfers.
+  transfer->queue = gulkan_device_get_graphics_queue (device);
+  transfer->recording = NULL;
+  transfer->staging = VK_NULL_HANDLE;
+  transfer->staging_device_local = false;
+  wl_list_init (&transfer->in_flight);
+  wl_list_init (&transfer->free_batches);
+  wl_list_init (&transfer->host_imports);
+
+  // command buffers are reused every frame
+  VkCommandPoolCreateInfo pool_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+    .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+    .queueFamilyIndex = gulkan_queue_get_family_index (transfer->queue),
+  };
+  VkResult res = vkCreateCommandPool (transfer->device, &pool_info, NULL,
+                                      &transfer->command_pool);
+  if (res != VK_SUCCESS) {
+    wlr_log (WLR_ERROR, "vkCreateCommandPool failed: %d", res);
+    return false;
+  }
+
+  // the backend only requests the extension if all devices support it
+  transfer->host_import = false;
+  transfer->host_pointer_alignment = 0;
+  transfer->get_memory_host_pointer_properties = NULL;
+  if (wxrd_vk_device_has_extension (
+          transfer->physical_device,
+          VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME)) {
+    transfer->get_memory_host_pointer_properties
+        = (PFN_vkGetMemoryHostPointerPropertiesEXT)vkGetDeviceProcAddr (
+            transfer->device, "vkGetMemoryHostPointerPropertiesEXT");
+  }
+
+  if (transfer->get_memory_host_pointer_properties != NULL) {
+    VkPhysicalDeviceExternalMemoryHostPropertiesEXT host_props = {
+      .sType
+      = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT,
+    };
+    VkPhysicalDeviceProperties2 props = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+      .pNext = &host_props,
+    };
+    vkGetPhysicalDeviceProperties2 (transfer->physical_device, &props);
+    transfer->host_pointer_alignment
+        = host_props.minImportedHostPointerAlignment;
+
+    // shm pools are only mapped with page granularity
+    transfer->host_import = transfer->host_pointer_alignment > 0
+                            && transfer->host_pointer_alignment
+                                   <= (VkDeviceSize)sysconf (_SC_PAGESIZE);
+  }
+
+  wlr_log (WLR_DEBUG, "shm host memory import %s, alignment %lu",
+           transfer->host_import ? "enabled" : "disabled",
+           transfer->host_pointer_alignment);
+
+  VkPhysicalDeviceProperties device_props;
+  vkGetPhysicalDeviceProperties (transfer->physical_device, &device_props);
+  // a power of two, at least one 32 bit texel
+  transfer->staging_align
+      = MAX (device_props.limits.optimalBufferCopyOffsetAlignment, 4);
+
+  // VRAM is the better place for the ring if the CPU can write it directly,
+  // WXRD_STAGING_MEMORY=host|device or the upload benchmark override it
+  transfer->rebar = has_rebar (transfer);
+  bool device_local = transfer->rebar;
+  const char *memory_env = getenv ("WXRD_STAGING_MEMORY");
+  if (memory_env != NULL) {
+    device_local = strcmp (memory_env, "device") == 0;
+  }
+
+  if (!staging_init (transfer, STAGING_RING_SIZE, device_local)
+      && !(device_local && staging_init (transfer, STAGING_RING_SIZE, false))) {
+    wlr_log (WLR_ERROR, "Failed to create staging ring, using gulkan uploads");
+  } else {
+    wlr_log (WLR_DEBUG, "Staging ring in %s memory%s",
+             transfer->staging_device_local ? "device" : "host",
+             transfer->rebar ? ", resizable BAR available" : "");
+  }
+
+  return true;
+}
+
+void
+wxrd_vk_transfer_retire (struct wxrd_vk_transfer *transfer)
+{
+  // submitted to one queue, so they finish in order
+  struct wxrd_vk_batch *batch, *tmp;
+  wl_list_for_each_safe (batch, tmp, &transfer->in_flight, link)
+  {
+    if (vkGetFenceStatus (transfer->device, batch->fence) != VK_SUCCESS) {
+      break;
+    }
+    transfer->staging_tail = batch->staging_end;
+    batch_release (transfer, batch);
+  }
+
+  if (wl_list_empty (&transfer->in_flight) && transfer->recording == NULL) {
+    transfer->staging_head = 0;
+    transfer->staging_tail = 0;
+  }
+}
+
+void
+wxrd_vk_transfer_wait (struct wxrd_vk_transfer *transfer)
+{
+  struct wxrd_vk_batch *batch;
+  wl_list_for_each (batch, &transfer->in_flight, link)
+  {
+    vkWaitForFences (transfer->device, 1, &batch->fence, VK_TRUE,
+                     UINT64_MAX);
+  }
+  wxrd_vk_transfer_retire (transfer);
+}
+
+void
+wxrd_vk_transfer_finish (struct wxrd_vk_transfer *transfer)
+{
+  wxrd_vk_transfer_flush (transfer);
+  wxrd_vk_transfer_wait (transfer);
+
+  struct wxrd_vk_batch *batch, *tmp;
+  wl_list_for_each_safe (batch, tmp, &transfer->free_batches, link)
+  {
+    batch_destroy (transfer, batch);
+  }
+
+  struct wxrd_vk_host_import *import, *tmp_import;
+  wl_list_for_each_safe (import, tmp_import, &transfer->host_imports, link)
+  {
+    host_import_uncache (import);
+  }
+
+  staging_finish (transfer);
+
+  if (transfer->command_pool != VK_NULL_HANDLE) {
+    vkDestroyCommandPool (transfer->device, transfer->command_pool, NULL);
+    transfer->command_pool = VK_NULL_HANDLE;
+  }
+}
+
+void
+wxrd_vk_transfer_flush (struct wxrd_vk_transfer *transfer)
+{
+  struct wxrd_vk_batch *batch = transfer->recording;
+  if (batch == NULL) {
+    return;
+  }
+  transfer->recording = NULL;
+
+  vkEndCommandBuffer (batch->cmd_buffer);
+
+  VkSubmitInfo submit_info = {
+    .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    .commandBufferCount = 1,
+    .pCommandBuffers = &batch->cmd_buffer,
+  };
+
+  // the queue is shared with gulkan and xrdesktop's rendering
+  GMutex *queue_mutex = gulkan_queue_get_pool_mutex (transfer->queue);
+  g_mutex_lock (queue_mutex);
+  VkResult res = vkQueueSubmit (gulkan_queue_get_handle (transfer->queue), 1,
+                                &submit_info, batch->fence);
+  g_mutex_unlock (queue_mutex);
+
+  if (res != VK_SUCCESS) {
+    wlr_log (WLR_ERROR, "vkQueueSubmit failed: %d", res);
+    // nothing of it reaches the GPU, its staging space is free again
+    batch_release (transfer, batch);
+    wxrd_vk_transfer_retire (transfer);
+    return;
+  }
+
+  wl_list_insert (transfer->in_flight.prev, &batch->link);
+}
+
+void *
+wxrd_vk_transfer_stage (struct wxrd_vk_transfer *transfer,
+                        VkDeviceSize size,
+                        VkDeviceSize *offset)
+{
+  if (transfer->staging == VK_NULL_HANDLE || size == 0) {
+    return NULL;
+  }
+
+  VkDeviceSize align = transfer->staging_align;
+  VkDeviceSize head = (transfer->staging_head + align - 1) & ~(align - 1);
+  VkDeviceSize tail = transfer->staging_tail;
+
+  // The used part is [tail, head), wrapped around the end if head < tail.
+  // head never catches up with tail, so head == tail means empty.
+  if (transfer->staging_head >= tail) {
+    if (head + size <= transfer->staging_size) {
+      *offset = head;
+    } else if (size < tail) {
+      *offset = 0;
+    } else {
+      return NULL;
+    }
+  } else if (head + size < tail) {
+    *offset = head;
+  } else {
+    return NULL;
+  }
+
+  struct wxrd_vk_batch *batch = get_recording_batch (transfer);
+  if (batch == NULL) {
+    return NULL;
+  }
+
+  transfer->staging_head = *offset + size;
+  batch->staging_end = transfer->staging_head;
+  return transfer->staging_map + *offset;
+}
+
+void
+wxrd_vk_transfer_write_staged (struct wxrd_vk_transfer *transfer,
+                               void *dst,
+                               const void *src,
+                               size_t size)
+{
+#ifdef __SSE2__
+  // Write combined VRAM: streaming stores skip reading the destination
+  // into the cache, which would go over the bus.
+  if (transfer->staging_device_local && size >= 64) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+    memcpy (d, s, head);
+    d += head;
+    s += head;
+    size -= head;
+    for (; size >= 16; size -= 16, d += 16, s += 16) {
+      _mm_stream_si128 ((__m128i *)d, _mm_loadu_si128 ((const __m128i *)s));
+    }
+    memcpy (d, s, size);
+    _mm_sfence ();
+    return;
+  }
+#endif
+  memcpy (dst, src, size);
+}
+
+/* Imports [ptr, ptr + size) as a transfer source buffer. ptr and size must
+ * be aligned to host_pointer_alignment. */
+static bool
+import_host_memory (struct wxrd_vk_transfer *transfer,
+                    void *ptr,
+                    VkDeviceSize size,
+                    struct wxrd_vk_host_import *import)
+{
+  VkMemoryHostPointerPropertiesEXT pointer_props = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT,
+  };
+  VkResult res = transfer->get_memory_host_pointer_properties (
+      transfer->device,
+      VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, ptr,
+      &pointer_props);
+  if (res != VK_SUCCESS) {
+    return false;
+  }
+
+  VkExternalMemoryBufferCreateInfo external_info = {
+    .sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO,
+    .handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+  };
+  VkBufferCreateInfo buffer_info = {
+    .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+    .pNext = &external_info,
+    .size = size,
+    .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+  };
+  res = vkCreateBuffer (transfer->device, &buffer_info, NULL, &import->buffer);
+  if (res != VK_SUCCESS) {
+    return false;
+  }
+
+  VkMemoryRequirements reqs;
+  vkGetBufferMemoryRequirements (transfer->device, import->buffer, &reqs);
+
+  uint32_t type_bits = reqs.memoryTypeBits & pointer_props.memoryTypeBits;
+  if (type_bits == 0 || reqs.size > size) {
+    vkDestroyBuffer (transfer->device, import->buffer, NULL);
+    return false;
+  }
+
+  VkImportMemoryHostPointerInfoEXT import_info = {
+    .sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT,
+    .handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+    .pHostPointer = ptr,
+  };
+  VkMemoryAllocateInfo alloc_info = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+    .pNext = &import_info,
+    .allocationSize = size,
+    .memoryTypeIndex = (uint32_t)__builtin_ctz (type_bits),
+  };
+  res = vkAllocateMemory (transfer->device, &alloc_info, NULL,
+                          &import->memory);
+  if (res != VK_SUCCESS) {
+    vkDestroyBuffer (transfer->device, import->buffer, NULL);
+    return false;
+  }
+
+  vkBindBufferMemory (transfer->device, import->buffer, import->memory, 0);
+  return true;
+}
+
+/* Returns the import of [start, end) of wlr_buffer, importing it unless it
+ * was imported for an earlier upload. NULL on failure. */
+static struct wxrd_vk_host_import *
+get_host_import (struct wxrd_vk_transfer *transfer,
+                 struct wlr_buffer *wlr_buffer,
+                 uintptr_t start,
+                 uintptr_t end)
+{
+  struct wxrd_vk_host_import *import;
+  wl_list_for_each (import, &transfer->host_imports, link)
+  {
+    if (import->wlr_buffer != wlr_buffer) {
+      continue;
+    }
+    if (import->start == start && import->end == end) {
+      return import;
+    }
+    // the pool was remapped
+    host_import_uncache (import);
+    break;
+  }
+
+  import = calloc (1, sizeof (*import));
+  if (import == NULL) {
+    return NULL;
+  }
+  if (!import_host_memory (transfer, (void *)start, end - start, import)) {
+    free (import);
+    return NULL;
+  }
+
+  import->transfer = transfer;
+  import->start = start;
+  import->end = end;
+  import->ref_count = 1;
+  import->wlr_buffer = wlr_buffer;
+  import->buffer_destroy.notify = host_import_handle_buffer_destroy;
+  wl_signal_add (&wlr_buffer->events.destroy, &import->buffer_destroy);
+  wl_list_insert (&transfer->host_imports, &import->link);
+  return import;
+}
+
+static void
+image_barrier (VkCommandBuffer cmd_buffer,
+               VkImage image,
+               VkImageLayout old_layout,
+               VkImageLayout new_layout,
+               VkAccessFlags src_access,
+               VkAccessFlags dst_access,
+               VkPipelineStageFlags src_stage,
+               VkPipelineStageFlags dst_stage,
+               uint32_t src_family,
+               uint32_t dst_family)
+{
+  VkImageMemoryBarrier barrier = {
+    .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+    .srcAccessMask = src_access,
+    .dstAccessMask = dst_access,
+    .oldLayout = old_layout,
+    .newLayout = new_layout,
+    .srcQueueFamilyIndex = src_family,
+    .dstQueueFamilyIndex = dst_family,
+    .image = image,
+    .subresourceRange = {
+      .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .levelCount = 1,
+      .layerCount = 1,
+    },
+  };
+  vkCmdPipelineBarrier (cmd_buffer, src_stage, dst_stage, 0, 0, NULL, 0, NULL,
+                        1, &barrier);
+}
+
+static void
+batch_add_texture (struct wxrd_vk_batch *batch, GulkanTexture *texture)
+{
+  GulkanTexture *ref = g_object_ref (texture);
+  GulkanTexture **textures = wl_array_add (&batch->textures, sizeof (ref));
+  if (textures != NULL) {
+    *textures = ref;
+  }
+}
+
+/* Records the copies of regions from buffer into texture */
+static void
+record_copy (struct wxrd_vk_batch *batch,
+             GulkanTexture *texture,
+             VkImageLayout old_layout,
+             VkImageLayout new_layout,
+             VkBuffer buffer,
+             const VkBufferImageCopy *regions,
+             int n_regions)
+{
+  VkImage image = gulkan_texture_get_image (texture);
+  image_barrier (batch->cmd_buffer, image, old_layout,
+                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                 VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+                 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                 VK_PIPELINE_STAGE_TRANSFER_BIT, VK_QUEUE_FAMILY_IGNORED,
+                 VK_QUEUE_FAMILY_IGNORED);
+
+  vkCmdCopyBufferToImage (batch->cmd_buffer, buffer, image,
+                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, n_regions,
+                          regions);
+
+  image_barrier (batch->cmd_buffer, image,
+                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, new_layout,
+                 VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
+                 VK_PIPELINE_STAGE_TRANSFER_BIT,
+                 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_QUEUE_FAMILY_IGNORED,
+                 VK_QUEUE_FAMILY_IGNORED);
+
+  batch_add_texture (batch, texture);
+}
+
+bool
+wxrd_vk_transfer_acquire_external (struct wxrd_vk_transfer *transfer,
+                                   GulkanTexture *texture,
+                                   VkImageLayout old_layout,
+                                   VkImageLayout new_layout)
+{
+  // init failed
+  if (transfer->command_pool == VK_NULL_HANDLE) {
+    return false;
+  }
+
+  struct wxrd_vk_batch *batch = get_recording_batch (transfer);
+  if (batch == NULL) {
+    return false;
+  }
+
+  // the client's writes are made available by the implicit release of the
+  // external owner, only the rendering has to wait
+  image_barrier (batch->cmd_buffer, gulkan_texture_get_image (texture),
+                 old_layout, new_layout, 0, VK_ACCESS_SHADER_READ_BIT,
+                 VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                 VK_QUEUE_FAMILY_EXTERNAL,
+                 gulkan_queue_get_family_index (transfer->queue));
+
+  batch_add_texture (batch, texture);
+  return true;
+}
+
+bool
+wxrd_vk_transfer_release_external (struct wxrd_vk_transfer *transfer,
+                                   GulkanTexture *texture,
+                                   VkImageLayout layout)
+{
+  // init failed
+  if (transfer->command_pool == VK_NULL_HANDLE) {
+    return false;
+  }
+
+  struct wxrd_vk_batch *batch = get_recording_batch (transfer);
+  if (batch == NULL) {
+    return false;
+  }
+
+  // the client's next acquire waits for our reads through implicit sync
+  image_barrier (batch->cmd_buffer, gulkan_texture_get_image (texture), layout,
+                 layout, VK_ACCESS_SHADER_READ_BIT, 0,
+                 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                 VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                 gulkan_queue_get_family_index (transfer->queue),
+                 VK_QUEUE_FAMILY_EXTERNAL);
+
+  batch_add_texture (batch, texture);
+  return true;
+}
+
+bool
+wxrd_vk_transfer_copy_staged (struct wxrd_vk_transfer *transfer,
+                              GulkanTexture *texture,
+                              VkImageLayout old_layout,
+                              VkImageLayout new_layout,
+                              VkDeviceSize offset,
+                              uint32_t bytes_per_texel,
+                              const pixman_box32_t *rects,
+                              int n_rects)
+{
+  // staged in this frame, so the batch is recording
+  struct wxrd_vk_batch *batch = transfer->recording;
+  if (batch == NULL) {
+    return false;
+  }
+
+  VkBufferImageCopy *regions = calloc (n_rects, sizeof (*regions));
+  if (regions == NULL) {
+    return false;
+  }
+  for (int i = 0; i < n_rects; i++) {
+    const pixman_box32_t *r = &rects[i];
+    uint32_t width = r->x2 - r->x1;
+    uint32_t height = r->y2 - r->y1;
+    regions[i] = (VkBufferImageCopy){
+      .bufferOffset = offset,
+      .bufferRowLength = 0,
+      .bufferImageHeight = 0,
+      .imageSubresource = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .layerCount = 1,
+      },
+      .imageOffset = { r->x1, r->y1, 0 },
+      .imageExtent = { width, height, 1 },
+    };
+    offset += (VkDeviceSize)width * height * bytes_per_texel;
+  }
+
+  record_copy (batch, texture, old_layout, new_layout, transfer->staging,
+               regions, n_rects);
+  free (regions);
+  return true;
+}
+
+bool
+wxrd_vk_transfer_copy_from_host (struct wxrd_vk_transfer *transfer,
+                                 GulkanTexture *texture,
+                                 VkImageLayout old_layout,
+                                 VkImageLayout new_layout,
+                                 struct wlr_buffer *wlr_buffer,
+                                 void *data,
+                                 size_t stride,
+                                 uint32_t height,
+                                 uint32_t bytes_per_texel,
+                                 const pixman_box32_t *rects,
+                                 int n_rects)
+{
+  if (!transfer->host_import || stride % bytes_per_texel != 0) {
+    return false;
+  }
+
+  // Import whole pages around the buffer. The pool is mapped with page
+  // granularity, so the rounded range stays inside the client's mapping.
+  uintptr_t alignment = transfer->host_pointer_alignment;
+  uintptr_t start = (uintptr_t)data & ~(alignment - 1);
+  uintptr_t end = ((uintptr_t)data + stride * height + alignment - 1)
+                  & ~(alignment - 1);
+  VkDeviceSize data_offset = (uintptr_t)data - start;
+  // the client picks the buffer's offset in its pool, copies need whole
+  // texels
+  if (data_offset % bytes_per_texel != 0) {
+    return false;
+  }
+
+  struct wxrd_vk_batch *batch = get_recording_batch (transfer);
+  if (batch == NULL) {
+    return false;
+  }
+
+  VkBufferImageCopy *regions = calloc (n_rects, sizeof (*regions));
+  if (regions == NULL) {
+    return false;
+  }
+
+  struct wxrd_vk_host_import *import
+      = get_host_import (transfer, wlr_buffer, start, end);
+  if (import == NULL) {
+    free (regions);
+    return false;
+  }
+
+  struct wxrd_vk_host_import **imports
+      = wl_array_add (&batch->host_imports, sizeof (import));
+  if (imports == NULL) {
+    free (regions);
+    return false;
+  }
+  import->ref_count++;
+  *imports = import;
+
+  struct wlr_buffer **wlr_buffers
+      = wl_array_add (&batch->wlr_buffers, sizeof (wlr_buffer));
+  if (wlr_buffers == NULL) {
+    free (regions);
+    return false;
+  }
+  *wlr_buffers = wlr_buffer_lock (wlr_buffer);
+
+  for (int i = 0; i < n_rects; i++) {
+    const pixman_box32_t *r = &rects[i];
+    regions[i] = (VkBufferImageCopy){
+      .bufferOffset
+      = data_offset + (VkDeviceSize)r->y1 * stride + r->x1 * bytes_per_texel,
+      .bufferRowLength = (uint32_t)(stride / bytes_per_texel),
+      .bufferImageHeight = 0,
+      .imageSubresource = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .layerCount = 1,
+      },
+      .imageOffset = { r->x1, r->y1, 0 },
+      .imageExtent = { (uint32_t)(r->x2 - r->x1), (uint32_t)(r->y2 - r->y1),
+                       1 },
+    };
+  }
+
+  record_copy (batch, texture, old_layout, new_layout, import->buffer,
+               regions, n_rects);
+  free (regions);
+  return true;
+}
+
+static int64_t
+get_now_ns (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return timespec_to_nsec (&now);
+}
+
+/* Returns the average latency of staged uploads of size x size rects, one
+ * rect per flush like a single damaged view per frame. -1 if the ring is
+ * too small. */
+static int64_t
+benchmark_staged (struct wxrd_vk_transfer *transfer,
+                  GulkanTexture *texture,
+                  const uint8_t *pixels,
+                  int32_t size)
+{
+  VkImageLayout layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  VkExtent2D extent = gulkan_texture_get_extent (texture);
+  size_t row_size = (size_t)size * 4;
+
+  int64_t start_ns = get_now_ns ();
+  for (int i = 0; i < BENCHMARK_ITERATIONS; i++) {
+    int32_t x = (i * size) % (int32_t)extent.width;
+    pixman_box32_t rect = { x, 0, x + size, size };
+    VkDeviceSize offset;
+    uint8_t *dst = wxrd_vk_transfer_stage (transfer, row_size * size, &offset);
+    if (dst == NULL) {
+      return -1;
+    }
+    for (int32_t y = 0; y < size; y++) {
+      wxrd_vk_transfer_write_staged (transfer, dst + y * row_size,
+                                     pixels + y * row_size, row_size);
+    }
+    wxrd_vk_transfer_copy_staged (transfer, texture, layout, layout, offset, 4,
+                                  &rect, 1);
+    wxrd_vk_transfer_flush (transfer);
+    wxrd_vk_transfer_wait (transfer);
+  }
+  return (get_now_ns () - start_ns) / BENCHMARK_ITERATIONS;
+}
+
+void
+wxrd_vk_transfer_benchmark (struct wxrd_vk_transfer *transfer,
+                            GulkanClient *client)
+{
+  VkExtent2D extent = { 1024, 1024 };
+  VkImageLayout layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+  GulkanTexture *texture
+      = gulkan_texture_new (client, extent, VK_FORMAT_B8G8R8A8_UNORM);
+  if (texture == NULL) {
+    return;
+  }
+  gulkan_texture_transfer_layout (texture, VK_IMAGE_LAYOUT_UNDEFINED, layout);
+
+  gsize pixels_size
+      = (gsize)BENCHMARK_LARGE_RECT_SIZE * BENCHMARK_LARGE_RECT_SIZE * 4;
+  uint8_t *pixels = malloc (pixels_size);
+  if (pixels == NULL) {
+    g_object_unref (texture);
+    return;
+  }
+  memset (pixels, 0x80, pixels_size);
+
+  // small damage like a blinking text cursor or a spinner
+  VkExtent2D rect_extent = { BENCHMARK_RECT_SIZE, BENCHMARK_RECT_SIZE };
+  gsize rect_size = (gsize)rect_extent.width * rect_extent.height * 4;
+  int64_t start_ns = get_now_ns ();
+  for (int i = 0; i < BENCHMARK_ITERATIONS; i++) {
+    VkOffset2D offset = { (i * BENCHMARK_RECT_SIZE) % extent.width, 0 };
+    gulkan_texture_upload_pixels_region (texture, pixels, rect_size, layout,
+                                         offset, rect_extent);
+  }
+  int64_t gulkan_ns = (get_now_ns () - start_ns) / BENCHMARK_ITERATIONS;
+
+  int64_t staged_ns
+      = benchmark_staged (transfer, texture, pixels, BENCHMARK_RECT_SIZE);
+  if (staged_ns < 0) {
+    wlr_log (WLR_INFO, "upload benchmark: gulkan %.1f us, no staging ring",
+             gulkan_ns / 1000.0);
+    free (pixels);
+    g_object_unref (texture);
+    return;
+  }
+  wlr_log (WLR_INFO,
+           "upload benchmark: %dx%d rect latency gulkan %.1f us, "
+           "staging ring %.1f us",
+           BENCHMARK_RECT_SIZE, BENCHMARK_RECT_SIZE, gulkan_ns / 1000.0,
+           staged_ns / 1000.0);
+
+  // keep the ring where window sized updates are faster
+  if (transfer->rebar) {
+    bool device_local = transfer->staging_device_local;
+    int64_t current_ns = benchmark_staged (transfer, texture, pixels,
+                                           BENCHMARK_LARGE_RECT_SIZE);
+
+    staging_finish (transfer);
+    int64_t other_ns = -1;
+    if (staging_init (transfer, STAGING_RING_SIZE, !device_local)) {
+      other_ns = benchmark_staged (transfer, texture, pixels,
+                                   BENCHMARK_LARGE_RECT_SIZE);
+    }
+
+    wlr_log (WLR_INFO,
+             "upload benchmark: %dx%d rect latency staging in host memory "
+             "%.1f us, device memory %.1f us",
+             BENCHMARK_LARGE_RECT_SIZE, BENCHMARK_LARGE_RECT_SIZE,
+             (device_local ? other_ns : current_ns) / 1000.0,
+             (device_local ? current_ns : other_ns) / 1000.0);
+
+    if (other_ns < 0 || other_ns >= current_ns) {
+      staging_finish (transfer);
+      staging_init (transfer, STAGING_RING_SIZE, device_local);
+    }
+    wlr_log (WLR_INFO, "Staging ring in %s memory",
+             transfer->staging_device_local ? "device" : "host");
+  }
+
+  free (pixels);
+  g_object_unref (texture);
+}
@@ -0,0 +1,191 @@
+/*
+ * wxrd
+ * Copyright 2021 Collabora Ltd.
+ * Author: Christoph Haag <christoph.haag@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef WXRD_VK_TRANSFER_H
+#define WXRD_VK_TRANSFER_H
+
+#include <pixman.h>
+#include <stdbool.h>
+#include <wayland-server.h>
+#include <wlr/types/wlr_buffer.h>
+
+#include <xrd.h>
+
+/* Copies into gulkan textures with our own command buffers on the graphics
+ * queue xrdesktop renders with, for what gulkan's upload API can't do. All
+ * copies and layout transitions of a frame are recorded into one command
+ * buffer that wxrd_vk_transfer_flush submits before the frame is rendered. */
+struct wxrd_vk_transfer
+{
+  VkDevice device;
+  VkPhysicalDevice physical_device;
+  GulkanQueue *queue;
+  VkCommandPool command_pool;
+
+  // VK_EXT_external_memory_host is enabled on the device
+  bool host_import;
+  VkDeviceSize host_pointer_alignment;
+  PFN_vkGetMemoryHostPointerPropertiesEXT get_memory_host_pointer_properties;
+  // imports of client buffers, kept until the buffer is destroyed
+  struct wl_list host_imports; // wxrd_vk_host_import.link
+
+  // persistently mapped host visible buffer the CPU packs damage into,
+  // used as a ring. VK_NULL_HANDLE if it could not be created.
+  VkBuffer staging;
+  VkDeviceMemory staging_memory;
+  uint8_t *staging_map;
+  VkDeviceSize staging_size;
+  VkDeviceSize staging_align;
+  // the ring is in VRAM mapped through a resizable BAR
+  bool staging_device_local;
+  bool rebar;
+  // next free byte, and the first byte still used by a batch
+  VkDeviceSize staging_head;
+  VkDeviceSize staging_tail;
+
+  // batch copies are recorded into, NULL if nothing was recorded yet
+  struct wxrd_vk_batch *recording;
+  struct wl_list in_flight;     // wxrd_vk_batch.link, oldest first
+  struct wl_list free_batches; // wxrd_vk_batch.link
+};
+
+/* Copies submitted together, their resources are freed once the fence
+ * signaled. */
+struct wxrd_vk_batch
+{
+  VkCommandBuffer cmd_buffer;
+  VkFence fence;
+
+  // staging ring offset behind the data of this batch
+  VkDeviceSize staging_end;
+
+  // kept alive until the copies finished
+  struct wl_array textures;     // GulkanTexture *
+  struct wl_array wlr_buffers;  // struct wlr_buffer *, locked
+  struct wl_array host_imports; // struct wxrd_vk_host_import *, referenced
+
+  struct wl_list link;
+};
+
+/* Client memory imported as a transfer source buffer. Imported once per
+ * wlr_buffer instead of every upload, importing pins all its pages. */
+struct wxrd_vk_host_import
+{
+  struct wxrd_vk_transfer *transfer;
+  VkBuffer buffer;
+  VkDeviceMemory memory;
+  // imported range, the client's mapping moves if it resizes the pool
+  uintptr_t start;
+  uintptr_t end;
+  // references of the cache and the batches in flight
+  int ref_count;
+
+  struct wlr_buffer *wlr_buffer;
+  struct wl_listener buffer_destroy;
+  struct wl_list link; // wxrd_vk_transfer.host_imports
+};
+
+/* Whether the device supports the device extension name. */
+bool
+wxrd_vk_device_has_extension (VkPhysicalDevice physical_device,
+                              const char *name);
+
+bool
+wxrd_vk_transfer_init (struct wxrd_vk_transfer *transfer,
+                       GulkanClient *client);
+
+/* Waits for all copies in flight and frees them. */
+void
+wxrd_vk_transfer_finish (struct wxrd_vk_transfer *transfer);
+
+/* Frees batches whose fence signaled, releasing their client buffers. */
+void
+wxrd_vk_transfer_retire (struct wxrd_vk_transfer *transfer);
+
+/* Submits the copies recorded since the last flush. */
+void
+wxrd_vk_transfer_flush (struct wxrd_vk_transfer *transfer);
+
+/* Waits until all submitted copies finished and retires them. */
+void
+wxrd_vk_transfer_wait (struct wxrd_vk_transfer *transfer);
+
+/* Reserves size bytes of the staging ring for the next flush. Returns the
+ * mapped pointer to write to, or NULL if the ring is full. May be written
+ * from any thread until the copy is recorded. */
+void *
+wxrd_vk_transfer_stage (struct wxrd_vk_transfer *transfer,
+                        VkDeviceSize size,
+                        VkDeviceSize *offset);
+
+/* Copies size bytes to dst in the staging ring, with streaming stores if
+ * the ring is in write combined VRAM. */
+void
+wxrd_vk_transfer_write_staged (struct wxrd_vk_transfer *transfer,
+                               void *dst,
+                               const void *src,
+                               size_t size);
+
+/* Records the acquire of an imported dmabuf from the external queue family
+ * the client rendered it on, with a layout transition, instead of a submit
+ * and wait of its own. Needed every time the client hands the dmabuf over
+ * again. */
+bool
+wxrd_vk_transfer_acquire_external (struct wxrd_vk_transfer *transfer,
+                                   GulkanTexture *texture,
+                                   VkImageLayout old_layout,
+                                   VkImageLayout new_layout);
+
+/* Records the release of an imported dmabuf back to the external queue
+ * family, after the frames submitted before sampled it. Must precede the
+ * next wxrd_vk_transfer_acquire_external of the texture, which has to use
+ * layout as old layout. */
+bool
+wxrd_vk_transfer_release_external (struct wxrd_vk_transfer *transfer,
+                                   GulkanTexture *texture,
+                                   VkImageLayout layout);
+
+/* Records copies of rects into texture from staged data at offset, the
+ * rects packed tightly one after another. The image is transitioned from
+ * old_layout to new_layout. */
+bool
+wxrd_vk_transfer_copy_staged (struct wxrd_vk_transfer *transfer,
+                              GulkanTexture *texture,
+                              VkImageLayout old_layout,
+                              VkImageLayout new_layout,
+                              VkDeviceSize offset,
+                              uint32_t bytes_per_texel,
+                              const pixman_box32_t *rects,
+                              int n_rects);
+
+/* Records copies of rects of a shm buffer straight from the client's memory
+ * into texture by importing it with VK_EXT_external_memory_host.
+ * data, stride, height: the mapped shm buffer, locked until the copy
+ * finished. The image is transitioned from old_layout to new_layout.
+ * Returns false without recording anything if the memory can't be
+ * imported. */
+bool
+wxrd_vk_transfer_copy_from_host (struct wxrd_vk_transfer *transfer,
+                                 GulkanTexture *texture,
+                                 VkImageLayout old_layout,
+                                 VkImageLayout new_layout,
+                                 struct wlr_buffer *wlr_buffer,
+                                 void *data,
+                                 size_t stride,
+                                 uint32_t height,
+                                 uint32_t bytes_per_texel,
+                                 const pixman_box32_t *rects,
+                                 int n_rects);
+
+/* Logs the latency of small damage uploads through gulkan and through the
+ * staging ring. With resizable BAR the ring is moved to host or device
+ * memory, whichever uploads window sized damage faster. */
+void
+wxrd_vk_transfer_benchmark (struct wxrd_vk_transfer *transfer,
+                            GulkanClient *client);
+
+#endif
@@ -22,9 +22,25 @@
 
 #include <drm_fourcc.h>
 
+#include "dmabuf-map.h"
+#include "frame-clock.h"
+#include "stats.h"
 #include "wxrd-renderer.h"
 
 #define ALWAYS_UPLOAD_FULL_TEXTURES false
+
+// every damage rect is a separate upload, collapse to the bounding box above
+#define MAX_DAMAGE_RECTS 8
+// upload the full texture if the damage covers more than this percentage
+#define FULL_UPLOAD_DAMAGE_PERCENT 75
+// full uploads of smaller textures are packed without the pack pool
+#define PACK_POOL_MIN_TEXELS (256 * 256)
+// threads packing shm damage of different views concurrently
+#define PACK_POOL_MAX_THREADS 4
+// one import thread, drivers mostly serialize imports anyway
+#define IMPORT_POOL_THREADS 1
+// edge of the tiles refined damage is diffed in
+#define REFINE_TILE_SIZE 64
 //#define DEBUG_BUFFER_LOCKS
 
 // save full shm textures as /tmp/updated_texture-i.png
@@ -57,6 +73,13 @@ save_texture (char *fn_base,
 }
 #endif
 
+static int64_t
+get_now_ns (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return timespec_to_nsec (&now);
+}
 
 static const struct wlr_renderer_impl renderer_impl;
 
@@ -78,6 +101,7 @@ static const struct wxrd_pixel_format formats[] = {
       .drm_format = DRM_FORMAT_ARGB8888,
       .depth = 32,
       .bpp = 32,
+      .buffer_bpp = 32,
       .vk_format = VK_FORMAT_B8G8R8A8_UNORM,
       .has_alpha = true,
   },
@@ -85,6 +109,7 @@ static const struct wxrd_pixel_format formats[] = {
       .drm_format = DRM_FORMAT_XRGB8888,
       .depth = 24,
       .bpp = 32,
+      .buffer_bpp = 32,
       .vk_format = VK_FORMAT_B8G8R8A8_UNORM,
       .has_alpha = false,
   },
@@ -92,6 +117,7 @@ static const struct wxrd_pixel_format formats[] = {
       .drm_format = DRM_FORMAT_XBGR8888,
       .depth = 24,
       .bpp = 32,
+      .buffer_bpp = 32,
       .vk_format = VK_FORMAT_R8G8B8A8_UNORM,
       .has_alpha = false,
   },
@@ -99,8 +125,65 @@ static const struct wxrd_pixel_format formats[] = {
       .drm_format = DRM_FORMAT_ABGR8888,
       .depth = 32,
       .bpp = 32,
+      .buffer_bpp = 32,
+      .vk_format = VK_FORMAT_R8G8B8A8_UNORM,
+      .has_alpha = true,
+  },
+
+  // no Vulkan equivalent, converted to one of the above while packing
+  {
+      .drm_format = DRM_FORMAT_BGRA8888,
+      .depth = 32,
+      .bpp = 32,
+      .buffer_bpp = 32,
+      .vk_format = VK_FORMAT_B8G8R8A8_UNORM,
+      .has_alpha = true,
+      .conversion = WXRD_CONVERT_SWAP32,
+  },
+  {
+      .drm_format = DRM_FORMAT_BGRX8888,
+      .depth = 24,
+      .bpp = 32,
+      .buffer_bpp = 32,
+      .vk_format = VK_FORMAT_B8G8R8A8_UNORM,
+      .has_alpha = false,
+      .conversion = WXRD_CONVERT_SWAP32,
+  },
+  {
+      .drm_format = DRM_FORMAT_RGBA8888,
+      .depth = 32,
+      .bpp = 32,
+      .buffer_bpp = 32,
       .vk_format = VK_FORMAT_R8G8B8A8_UNORM,
       .has_alpha = true,
+      .conversion = WXRD_CONVERT_SWAP32,
+  },
+  {
+      .drm_format = DRM_FORMAT_RGBX8888,
+      .depth = 24,
+      .bpp = 32,
+      .buffer_bpp = 32,
+      .vk_format = VK_FORMAT_R8G8B8A8_UNORM,
+      .has_alpha = false,
+      .conversion = WXRD_CONVERT_SWAP32,
+  },
+  {
+      .drm_format = DRM_FORMAT_RGB888,
+      .depth = 24,
+      .bpp = 32,
+      .buffer_bpp = 24,
+      .vk_format = VK_FORMAT_B8G8R8A8_UNORM,
+      .has_alpha = false,
+      .conversion = WXRD_CONVERT_EXPAND24,
+  },
+  {
+      .drm_format = DRM_FORMAT_BGR888,
+      .depth = 24,
+      .bpp = 32,
+      .buffer_bpp = 24,
+      .vk_format = VK_FORMAT_R8G8B8A8_UNORM,
+      .has_alpha = false,
+      .conversion = WXRD_CONVERT_EXPAND24,
   },
 };
 
@@ -121,17 +204,6 @@ struct
       true,
   },
 
-  {
-      DRM_FORMAT_BGRA8888,
-      VK_FORMAT_A8B8G8R8_UNORM_PACK32,
-      true,
-  }, // TODO
-  {
-      DRM_FORMAT_RGBA8888,
-      VK_FORMAT_A8B8G8R8_UNORM_PACK32,
-      true,
-  }, // TODO
-
   {
       DRM_FORMAT_XBGR8888,
       VK_FORMAT_R8G8B8A8_UNORM,
@@ -142,18 +214,9 @@ struct
       VK_FORMAT_B8G8R8A8_UNORM,
       false,
   },
-
-  {
-      DRM_FORMAT_RGBX8888,
-      VK_FORMAT_A8B8G8R8_UNORM_PACK32,
-      false,
-  }, // TODO
-  {
-      DRM_FORMAT_BGRX8888,
-      VK_FORMAT_A8B8G8R8_UNORM_PACK32,
-      false,
-  }, // TODO
-     //  { DRM_FORMAT_NV12, VK_FORMAT_G8_B8R8_2PLANE_420_UNORM, false, },
+  // BGRA8888 and friends have no Vulkan format the GPU could sample a
+  // dmabuf with, shm buffers of them are converted instead
+  //  { DRM_FORMAT_NV12, VK_FORMAT_G8_B8R8_2PLANE_420_UNORM, false, },
   {
       DRM_FORMAT_INVALID,
       VK_FORMAT_UNDEFINED,
@@ -301,17 +364,23 @@ void
 init_formats (VkPhysicalDevice physicalDevice);
 
 static const struct wlr_drm_format_set *
-wxrd_get_dmabuf_formats (struct wlr_renderer *wlr_renderer)
+get_supported_formats (struct wxrd_renderer *renderer)
 {
-  TRACE_FN
   if (supported_formats.len == 0) {
-    struct wxrd_renderer *renderer = wxrd_get_renderer (wlr_renderer);
+    wlr_log (WLR_DEBUG, "Init formats");
     GulkanClient *gulkan = xrd_shell_get_gulkan (renderer->xrd_shell);
     init_formats (gulkan_client_get_physical_device_handle (gulkan));
   }
   return &supported_formats;
 }
 
+static const struct wlr_drm_format_set *
+wxrd_get_dmabuf_formats (struct wlr_renderer *wlr_renderer)
+{
+  TRACE_FN
+  return get_supported_formats (wxrd_get_renderer (wlr_renderer));
+}
+
 static const struct wlr_drm_format_set *
 wxrd_get_dmabuf_render_formats (struct wlr_renderer *wlr_renderer)
 {
@@ -388,6 +457,19 @@ wxrd_render_destroy (struct wlr_renderer *wlr_renderer)
 {
   TRACE_FN
   struct wxrd_renderer *renderer = wxrd_get_renderer (wlr_renderer);
+  if (renderer->pack_pool != NULL) {
+    g_thread_pool_free (renderer->pack_pool, FALSE, TRUE);
+  }
+  if (renderer->import_pool != NULL) {
+    g_thread_pool_free (renderer->import_pool, FALSE, TRUE);
+  }
+  wxrd_vk_transfer_finish (&renderer->transfer);
+  wxrd_dmabuf_cache_finish (&renderer->dmabuf_cache);
+  wxrd_texture_pool_finish (&renderer->texture_pool);
+  wlr_drm_format_set_finish (&renderer->udmabuf_failed);
+  wlr_drm_format_set_finish (&renderer->dmabuf_failed);
+  g_mutex_clear (&renderer->pack_mutex);
+  g_cond_clear (&renderer->pack_cond);
   if (renderer->drm_fd >= 0) {
     close (renderer->drm_fd);
   }
@@ -402,12 +484,6 @@ wxrd_texture_is_opaque (struct wlr_texture *wlr_texture)
   return !texture->has_alpha;
 }
 
-/* stride: length of a row in bytes
- * width, height: texel extent of the area to copy
- * src_x, src_y: texel coordinates of the rect to copy in the full src texture
- * dst_x, dst_y: texel coordinates of the rect to copy in the full dst texture
- * data: pointer to full source texture
- */
 static bool
 wxrd_texture_write_pixels (struct wlr_texture *wlr_texture,
                            uint32_t stride,
@@ -420,90 +496,38 @@ wxrd_texture_write_pixels (struct wlr_texture *wlr_texture,
                            const void *data)
 {
   TRACE_FN
-  struct wxrd_texture *texture = wxrd_get_texture (wlr_texture);
-
-  const struct wxrd_pixel_format *fmt
-      = get_wxrd_format_from_drm (texture->drm_format);
-  assert (fmt);
-
-#ifdef SAVE_UPDATED_TEXTURE
-  {
-    static int i = 0;
-    save_texture ("updated_texture", i++, (uint8_t *)data,
-                  texture->wlr_texture.width, texture->wlr_texture.height,
-                  stride);
-  }
-#endif
-
-  // the texel offset of the copied region in the full texture
-  VkOffset2D offset = { .x = dst_x, .y = dst_y };
-  // texel width and height of the region to copy.
-  VkExtent2D extent = { .width = width, .height = height };
-  int bytes_per_texel = fmt->bpp / 8;
-  G3kContext *g3k = xrd_shell_get_g3k (texture->renderer->xrd_shell);
-  VkImageLayout layout = g3k_context_get_upload_layout (g3k);
-  gsize full_size = texture->wlr_texture.width * texture->wlr_texture.height
-                    * bytes_per_texel;
-
-  // wlr_log(WLR_DEBUG, "Uploading %dx%d src offset %d,%d dst offset
-  // %d,%d, extent %d,%d, format %d, Bpp %d", width, height, src_x,
-  // src_y, offset.x, offset.y, extent.width, extent.height,
-  // fmt->vk_format, bytes_per_texel);
-
-  if ((width == texture->wlr_texture.width
-       && height == texture->wlr_texture.height)
-      || ALWAYS_UPLOAD_FULL_TEXTURES) {
-    gulkan_texture_upload_pixels (texture->gk, (guchar *)data, full_size,
-                                  layout);
-  } else {
-    /* TODO gulkan_texture_upload_pixels_region uses memcpy to copy
-     * data into a mapped vk buffer without using stride etc.
-     * Therefore we cut & paste the pixel region from data into
-     * region_data using several memcpy. Ideally gulkan would
-     * create a vk buffer from the region in the full data.
-     */
-
-    // size of the region to copy in bytes
-    gsize region_size = width * height * bytes_per_texel;
-
-    // avoid allocating a fitting buffer every frame, just allocate
-    // one that can hold all data once texture->region_data =
-    if (texture->region_data == NULL) {
-      texture->region_data = malloc (full_size);
-    }
-    uint8_t *region_ptr = texture->region_data;
-
-    uint8_t *data_ptr = (uint8_t *)data;
-    data_ptr += stride * src_y + src_x * bytes_per_texel;
-
-    uint32_t region_stride = width * bytes_per_texel;
+  // Never upload at the client's commit rate. Returning false makes wlroots
+  // create a new texture from the whole buffer, which is only uploaded if it
+  // is still the newest one at the XR frame latch.
+  return false;
+}
 
-    for (uint32_t i = 0; i < height; i++) {
-      memcpy (region_ptr, data_ptr, region_stride);
-      data_ptr += stride;
-      region_ptr += region_stride;
-    }
+/* Copy of the contents of a gulkan texture in the client buffer's format,
+ * attached to the texture. Refined damage is diffed against it. */
+struct wxrd_texture_shadow
+{
+  uint32_t width, height, drm_format;
+  uint32_t stride;
+  uint8_t data[];
+};
 
-    gulkan_texture_upload_pixels_region (texture->gk,
-                                         (guchar *)texture->region_data,
-                                         region_size, layout, offset, extent);
+static const char *shadow_key = "wxrd-texture-shadow";
+// struct wlr_box, buffer rect a gulkan texture holds
+static const char *crop_key = "wxrd-texture-crop";
 
-#ifdef SAVE_UPDATED_TEXTURE_REGION
-    {
-      static int i = 0;
-      save_texture ("updated_texture_region", i++,
-                    (uint8_t *)texture->region_data, width, height, stride);
-    }
-#endif
-  }
+static void
+texture_wait_packed (struct wxrd_texture *texture);
 
-  return true;
-}
+static void
+import_unref (struct wxrd_dmabuf_import *import);
 
 static void
 wxrd_texture_destroy (struct wxrd_texture *texture)
 {
   TRACE_FN
+  // a pack pool worker may still read the pending buffer
+  texture_wait_packed (texture);
+
   wl_list_remove (&texture->link);
   wl_list_remove (&texture->buffer_destroy.link);
 #ifdef DEBUG_BUFFER_LOCKS
@@ -511,19 +535,40 @@ wxrd_texture_destroy (struct wxrd_texture *texture)
            (void *)texture, (void *)texture->gk, texture->buffer,
            texture->buffer ? texture->buffer->n_locks : 0);
 #endif
-  // HACK free the textures we extra reffed in wxrd_texture_from_*
-#if 1 // gulkan texture is owned and cleared by xrdesktop after
-      // xrd_window_set_and_submit
+  // XR frames in flight may still sample the gulkan texture, it is unreffed
+  // (or recycled) once they completed
   if (texture->gk) {
     if (G_IS_OBJECT (texture->gk)) {
-      wlr_log (WLR_DEBUG, "unref gulkan texture gk %p", (void *)texture->gk);
-      g_object_unref (texture->gk);
+      wlr_log (WLR_DEBUG, "release gulkan texture gk %p", (void *)texture->gk);
+      if (texture->has_dmabuf_key) {
+        // the client may wrap the same dmabuf in a new buffer
+        wxrd_dmabuf_cache_put (&texture->renderer->dmabuf_cache,
+                               &texture->dmabuf_key, texture->gk,
+                               get_now_ns ());
+      } else {
+        wxrd_texture_pool_release (&texture->renderer->texture_pool,
+                                   texture->gk);
+      }
     } else {
       wlr_log (WLR_ERROR, "Not clearing non object gulkan texture");
     }
   }
-#endif
 
+  if (texture->pending_buffer != NULL) {
+    // superseded before it was ever uploaded, release it to the client
+    wlr_buffer_unlock (texture->pending_buffer);
+    wxrd_stats.buffers_superseded++;
+  }
+
+  if (texture->import != NULL) {
+    import_unref (texture->import);
+  }
+
+  if (texture->upload_shadow_fill) {
+    free (texture->upload_shadow);
+  }
+
+  pixman_region32_fini (&texture->upload_region);
   free (texture->region_data);
   free (texture);
 
@@ -558,6 +603,106 @@ static const struct wlr_texture_impl texture_impl = {
   .destroy = wxrd_texture_unref,
 };
 
+static struct wxrd_texture *
+texture_create (struct wxrd_renderer *renderer,
+                uint32_t width,
+                uint32_t height,
+                uint32_t drm_format,
+                bool has_alpha)
+{
+  struct wxrd_texture *texture = calloc (1, sizeof (struct wxrd_texture));
+  if (texture == NULL) {
+    wlr_log (WLR_ERROR, "Allocation failed");
+    return NULL;
+  }
+  wlr_texture_init (&texture->wlr_texture, &texture_impl, width, height);
+
+  wl_list_insert (&renderer->textures, &texture->link);
+  wl_list_init (&texture->buffer_destroy.link);
+
+  texture->renderer = renderer;
+  texture->has_alpha = has_alpha;
+  texture->drm_format = drm_format;
+  texture->crop = (struct wlr_box){ 0, 0, width, height };
+  pixman_region32_init (&texture->upload_region);
+
+  return texture;
+}
+
+/* Creates the gulkan texture for a texture with a shm format */
+static bool
+texture_create_gk (struct wxrd_texture *texture)
+{
+  const struct wxrd_pixel_format *fmt
+      = get_wxrd_format_from_drm (texture->drm_format);
+  assert (fmt);
+
+  VkExtent2D extent
+      = (VkExtent2D){ texture->crop.width, texture->crop.height };
+
+  struct wlr_box *crop = malloc (sizeof (*crop));
+  if (crop == NULL) {
+    wlr_log (WLR_ERROR, "Allocation failed");
+    return false;
+  }
+  *crop = texture->crop;
+
+  GulkanTexture *gk = wxrd_texture_pool_get (&texture->renderer->texture_pool,
+                                             extent, fmt->vk_format);
+  if (gk == NULL) {
+    wlr_log (WLR_ERROR, "Failed to create %dx%d texture", extent.width,
+             extent.height);
+    free (crop);
+    return false;
+  }
+  // a recycled texture's shadow describes contents that are replaced now
+  g_object_set_data (G_OBJECT (gk), shadow_key, NULL);
+  g_object_set_data_full (G_OBJECT (gk), crop_key, crop, free);
+  texture->gk = gk;
+  return true;
+}
+
+/* Uploads a full shm buffer with the given row stride */
+static bool
+texture_upload_full (struct wxrd_texture *texture,
+                     const void *data,
+                     uint32_t stride)
+{
+  const struct wxrd_pixel_format *fmt
+      = get_wxrd_format_from_drm (texture->drm_format);
+  assert (fmt);
+
+  uint32_t width = texture->wlr_texture.width;
+  uint32_t height = texture->wlr_texture.height;
+  uint32_t packed_stride = width * (fmt->bpp / 8);
+  gsize size = packed_stride * height;
+
+  G3kContext *g3k = xrd_shell_get_g3k (texture->renderer->xrd_shell);
+  VkImageLayout layout = g3k_context_get_upload_layout (g3k);
+
+  // gulkan expects tightly packed rows
+  if (stride != packed_stride || fmt->conversion != WXRD_CONVERT_NONE) {
+    if (texture->region_data == NULL) {
+      texture->region_data = malloc (size);
+      if (texture->region_data == NULL) {
+        wlr_log (WLR_ERROR, "Failed to allocate %zu bytes to pack", size);
+        return false;
+      }
+    }
+    const uint8_t *src = data;
+    for (uint32_t i = 0; i < height; i++) {
+      wxrd_convert_row (fmt->conversion,
+                        texture->region_data + i * packed_stride,
+                        src + i * stride, width);
+    }
+    data = texture->region_data;
+  }
+
+  gulkan_texture_upload_pixels (texture->gk, (guchar *)data, size, layout);
+  wxrd_stats.upload_bytes += size;
+  return true;
+}
+
 struct wlr_texture *
 wxrd_texture_from_pixels (struct wlr_renderer *wlr_renderer,
                           uint32_t drm_format,
@@ -574,39 +719,25 @@ wxrd_texture_from_pixels (struct wlr_renderer *wlr_renderer,
     return NULL;
   }
 
-  struct wxrd_texture *texture = calloc (1, sizeof (struct wxrd_texture));
+  struct wxrd_texture *texture = texture_create (
+      renderer, width, height, fmt->drm_format, fmt->has_alpha);
   if (texture == NULL) {
-    wlr_log (WLR_ERROR, "Allocation failed");
     return NULL;
   }
-  wlr_texture_init (&texture->wlr_texture, &texture_impl, width, height);
-
-  wl_list_insert (&renderer->textures, &texture->link);
-  wl_list_init (&texture->buffer_destroy.link);
-
-
-  texture->renderer = renderer;
-  texture->has_alpha = fmt->has_alpha;
-  texture->drm_format = fmt->drm_format;
-
-  G3kContext *g3k = xrd_shell_get_g3k (texture->renderer->xrd_shell);
-  VkImageLayout layout = g3k_context_get_upload_layout (g3k);
-  GulkanClient *client = xrd_shell_get_gulkan (renderer->xrd_shell);
-  VkExtent2D extent = (VkExtent2D){ width, height };
-
-  gsize size = width * height * (fmt->bpp / 8);
 
-  // HACK ref texture so the returned wxrd_texture has shared ownership
-  // of the texture->gk we will free it in wxrd_texture_destroy
-  texture->gk
-      = g_object_ref (gulkan_texture_new (client, extent, fmt->vk_format));
+  if (!texture_create_gk (texture)) {
+    wxrd_texture_destroy (texture);
+    return NULL;
+  }
 
-  wlr_log (WLR_DEBUG,
-           "%dx%d texture stride %d bpp %d size %lu from pixels (%p, %p)",
-           width, height, stride, fmt->bpp, size, (void *)texture,
+  wlr_log (WLR_DEBUG, "%dx%d texture stride %d bpp %d from pixels (%p, %p)",
+           width, height, stride, fmt->bpp, (void *)texture,
            (void *)texture->gk);
 
-  gulkan_texture_upload_pixels (texture->gk, (guchar *)data, size, layout);
+  if (!texture_upload_full (texture, data, stride)) {
+    wxrd_texture_destroy (texture);
+    return NULL;
+  }
 
   return &texture->wlr_texture;
 }
@@ -761,34 +892,28 @@ init_formats (VkPhysicalDevice vk_physical_device)
   }
 }
 
-struct wlr_texture *
-wxrd_texture_from_dmabuf (struct wlr_renderer *wlr_renderer,
-                          struct wlr_dmabuf_attributes *attribs)
+/* Records the acquire of the client's dmabuf before it is sampled.
+ * old_layout: UNDEFINED for a fresh import, else the layout it was left in. */
+static void
+texture_acquire_dmabuf (struct wxrd_texture *texture, VkImageLayout old_layout)
 {
-  TRACE_FN
-  struct wxrd_renderer *renderer = wxrd_get_renderer (wlr_renderer);
-
-  struct wxrd_texture *texture = calloc (1, sizeof (struct wxrd_texture));
-  if (texture == NULL) {
-    wlr_log (WLR_ERROR, "Allocation failed");
-    return NULL;
+  // submitted with the uploads of the frame
+  if (!wxrd_vk_transfer_acquire_external (
+          &texture->renderer->transfer, texture->gk, old_layout,
+          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL)) {
+    gulkan_texture_transfer_layout (texture->gk, old_layout,
+                                    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
   }
-  wlr_texture_init (&texture->wlr_texture, &texture_impl, attribs->width,
-                    attribs->height);
-
-  wl_list_insert (&renderer->textures, &texture->link);
-  wl_list_init (&texture->buffer_destroy.link);
-
-  texture->renderer = renderer;
-  texture->has_alpha = true;
-  texture->drm_format = DRM_FORMAT_INVALID; // texture can't be written
-
-  GulkanClient *client = xrd_shell_get_gulkan (renderer->xrd_shell);
+  texture->dmabuf_acquire = false;
+}
 
-  if (supported_formats.len == 0) {
-    wlr_log (WLR_DEBUG, "Init formats");
-    init_formats (gulkan_client_get_physical_device_handle (client));
-  }
+static bool
+texture_import_dmabuf (struct wxrd_texture *texture,
+                       struct wlr_dmabuf_attributes *attribs)
+{
+  GulkanClient *client = xrd_shell_get_gulkan (texture->renderer->xrd_shell);
+  get_supported_formats (texture->renderer);
+  int64_t start_ns = get_now_ns ();
 
   wlr_log (WLR_DEBUG, "creating %dx%d texture from dmabuf", attribs->width,
            attribs->height);
@@ -796,76 +921,242 @@ wxrd_texture_from_dmabuf (struct wlr_renderer *wlr_renderer,
   struct GulkanDmabufAttributes gulkan_attribs
       = _make_gulkan_attribs (attribs);
 
-  // HACK ref texture so the returned wxrd_texture has shared ownership
-  // of the texture->gk we will free it in wxrd_texture_destroy
-  texture->gk = g_object_ref (
-      gulkan_texture_new_from_dmabuf_attribs (client, &gulkan_attribs));
+  texture->gk
+      = gulkan_texture_new_from_dmabuf_attribs (client, &gulkan_attribs);
   if (!texture->gk) {
     wlr_log (WLR_ERROR, "Failed to create texture");
-    return NULL;
+    return false;
   }
-  gulkan_texture_transfer_layout (texture->gk, VK_IMAGE_LAYOUT_UNDEFINED,
-                                  VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+  texture_acquire_dmabuf (texture, VK_IMAGE_LAYOUT_UNDEFINED);
 
-  return &texture->wlr_texture;
+  wxrd_stats.buffers_imported++;
+  wxrd_stats.import_ns += get_now_ns () - start_ns;
+  return true;
 }
 
-static uint32_t
-wxrd_get_render_buffer_caps (struct wlr_renderer *renderer)
+static void
+import_unref (struct wxrd_dmabuf_import *import)
 {
-  TRACE_FN
-  // wlr_log (WLR_ERROR, "wxrd_get_render_buffer_caps: dmabuf");
-  return WLR_BUFFER_CAP_DMABUF;
+  if (!g_atomic_int_dec_and_test (&import->ref_count)) {
+    return;
+  }
+  // never latched, nothing sampled it
+  if (import->gk != NULL) {
+    g_object_unref (import->gk);
+  }
+  wlr_dmabuf_attributes_finish (&import->attribs);
+  free (import);
 }
 
 static void
-texture_handle_buffer_destroy (struct wl_listener *listener, void *data)
+import_pool_func (gpointer data, gpointer user_data)
 {
-  TRACE_FN
-  struct wxrd_texture *texture
-      = wl_container_of (listener, texture, buffer_destroy);
-  wlr_log (WLR_DEBUG, "texture_handle_buffer_destroy %p", (void *)texture->gk);
+  struct wxrd_dmabuf_import *import = data;
+
+  // the texture is gone already
+  if (g_atomic_int_get (&import->ref_count) > 1) {
+    int64_t start_ns = get_now_ns ();
+    struct GulkanDmabufAttributes gulkan_attribs
+        = _make_gulkan_attribs (&import->attribs);
+    import->gk
+        = gulkan_texture_new_from_dmabuf_attribs (import->client,
+                                                  &gulkan_attribs);
+    import->done_ns = get_now_ns ();
+    import->import_ns = import->done_ns - start_ns;
+  }
 
-  wxrd_texture_destroy(texture);
+  g_atomic_int_set (&import->done, 1);
+  import_unref (import);
 }
 
-static struct wlr_texture *
-wxrd_texture_from_dmabuf_buffer (struct wxrd_renderer *renderer,
-                                 struct wlr_buffer *buffer,
-                                 struct wlr_dmabuf_attributes *dmabuf)
+/* Starts importing the dmabuf of a newly committed buffer on the import
+ * pool. wxrd_texture_latch falls back to importing it itself if that is not
+ * possible. */
+static void
+texture_start_import (struct wxrd_texture *texture,
+                      struct wlr_dmabuf_attributes *attribs)
 {
-  TRACE_FN
-  struct wxrd_texture *texture;
-  // wlr_log (WLR_DEBUG, "wxrd_texture_from_dmabuf_buffer");
+  struct wxrd_renderer *renderer = texture->renderer;
+  if (renderer->import_pool == NULL || renderer->suspended
+      || texture->gk != NULL || texture->import != NULL) {
+    return;
+  }
 
-  wl_list_for_each (texture, &renderer->textures, link)
-  {
-#ifdef DEBUG_BUFFER_LOCKS
-    wlr_log (WLR_DEBUG, "Check if we already saw buffer %p [%zu]: %p [%zu]",
-             buffer, buffer ? buffer->n_locks : 0, texture->buffer,
-             texture->buffer ? texture->buffer->n_locks : 0);
-#endif
-    if (texture->buffer == buffer) {
-      // TODO nothing to do?
-      // wlr_log(WLR_ERROR, "invalidate texture");
-      wlr_buffer_lock (texture->buffer);
-#ifdef DEBUG_BUFFER_LOCKS
-      wlr_log (WLR_DEBUG,
-               "reused: texture %p gk %p lock & invalidate buffer %p [%zu]",
-               (void *)texture, (void *)texture->gk, texture->buffer,
-               texture->buffer->n_locks);
-#endif
-      return &texture->wlr_texture;
-    }
+  struct wxrd_dmabuf_import *import = calloc (1, sizeof (*import));
+  if (import == NULL) {
+    return;
+  }
+  // the client may destroy the buffer before the worker gets to it
+  if (!wlr_dmabuf_attributes_copy (&import->attribs, attribs)) {
+    free (import);
+    return;
   }
+  get_supported_formats (renderer);
+  import->client = xrd_shell_get_gulkan (renderer->xrd_shell);
+  import->start_ns = get_now_ns ();
+  // one for the texture, one for the worker
+  import->ref_count = 2;
+
+  texture->import = import;
+  g_thread_pool_push (renderer->import_pool, import, NULL);
+}
 
-  struct wlr_texture *wlr_texture
-      = wxrd_texture_from_dmabuf (&renderer->base, dmabuf);
-  if (wlr_texture == NULL) {
-    return false;
+/* Reuses the gulkan texture of a destroyed buffer of the same dmabuf */
+static void
+texture_lookup_import (struct wxrd_texture *texture,
+                       struct wlr_dmabuf_attributes *attribs)
+{
+  if (texture->gk != NULL || texture->import != NULL
+      || texture->has_dmabuf_key) {
+    return;
+  }
+  texture->has_dmabuf_key
+      = wxrd_dmabuf_key_init (&texture->dmabuf_key, attribs);
+  if (!texture->has_dmabuf_key) {
+    return;
   }
 
-  texture = wxrd_get_texture (wlr_texture);
+  // released in SHADER_READ_ONLY_OPTIMAL, acquired again at the latch
+  texture->gk = wxrd_dmabuf_cache_take (&texture->renderer->dmabuf_cache,
+                                        &texture->dmabuf_key);
+  texture->dmabuf_acquire = texture->gk != NULL;
+}
+
+/* Takes the result of a finished import. Returns false if it failed. */
+static bool
+texture_finish_import (struct wxrd_texture *texture)
+{
+  struct wxrd_dmabuf_import *import = texture->import;
+  texture->import = NULL;
+
+  texture->gk = import->gk;
+  import->gk = NULL;
+  if (texture->gk != NULL) {
+    texture_acquire_dmabuf (texture, VK_IMAGE_LAYOUT_UNDEFINED);
+    texture->import_latency_ns = import->done_ns - import->start_ns;
+    wxrd_stats.buffers_imported++;
+    wxrd_stats.import_ns += import->import_ns;
+  } else {
+    wlr_log (WLR_ERROR, "Failed to import dmabuf");
+  }
+
+  import_unref (import);
+  return texture->gk != NULL;
+}
+
+/* Formats without an alpha channel, e.g. XRGB8888, are opaque */
+static bool
+dmabuf_format_has_alpha (uint32_t drm_format)
+{
+  for (size_t i = 0; format_table[i].drm_format != DRM_FORMAT_INVALID; i++) {
+    if (format_table[i].drm_format == drm_format) {
+      return format_table[i].has_alpha;
+    }
+  }
+  return true;
+}
+
+struct wlr_texture *
+wxrd_texture_from_dmabuf (struct wlr_renderer *wlr_renderer,
+                          struct wlr_dmabuf_attributes *attribs)
+{
+  TRACE_FN
+  struct wxrd_renderer *renderer = wxrd_get_renderer (wlr_renderer);
+
+  // texture can't be written
+  struct wxrd_texture *texture = texture_create (
+      renderer, attribs->width, attribs->height, DRM_FORMAT_INVALID,
+      dmabuf_format_has_alpha (attribs->format));
+  if (texture == NULL) {
+    return NULL;
+  }
+
+  // imported in wxrd_texture_latch, only if it is still the newest buffer
+  return &texture->wlr_texture;
+}
+
+static uint32_t
+wxrd_get_render_buffer_caps (struct wlr_renderer *renderer)
+{
+  TRACE_FN
+  // wlr_log (WLR_ERROR, "wxrd_get_render_buffer_caps: dmabuf");
+  return WLR_BUFFER_CAP_DMABUF;
+}
+
+static void
+texture_handle_buffer_destroy (struct wl_listener *listener, void *data)
+{
+  TRACE_FN
+  struct wxrd_texture *texture
+      = wl_container_of (listener, texture, buffer_destroy);
+  wlr_log (WLR_DEBUG, "texture_handle_buffer_destroy %p", (void *)texture->gk);
+
+  wxrd_texture_destroy(texture);
+}
+
+/* Returns the texture of a buffer that was imported before, NULL if there
+ * is none. */
+static struct wxrd_texture *
+texture_find_buffer (struct wxrd_renderer *renderer,
+                     struct wlr_buffer *buffer)
+{
+  struct wxrd_texture *texture;
+  wl_list_for_each (texture, &renderer->textures, link)
+  {
+    if (texture->buffer == buffer) {
+      return texture;
+    }
+  }
+  return NULL;
+}
+
+/* Returns the locked texture of a buffer that was imported before. */
+static struct wlr_texture *
+texture_lookup_buffer (struct wxrd_renderer *renderer,
+                       struct wlr_buffer *buffer)
+{
+  struct wxrd_texture *texture;
+  wl_list_for_each (texture, &renderer->textures, link)
+  {
+#ifdef DEBUG_BUFFER_LOCKS
+    wlr_log (WLR_DEBUG, "Check if we already saw buffer %p [%zu]: %p [%zu]",
+             buffer, buffer ? buffer->n_locks : 0, texture->buffer,
+             texture->buffer ? texture->buffer->n_locks : 0);
+#endif
+    if (texture->buffer == buffer) {
+      // TODO nothing to do?
+      // wlr_log(WLR_ERROR, "invalidate texture");
+      wlr_buffer_lock (texture->buffer);
+#ifdef DEBUG_BUFFER_LOCKS
+      wlr_log (WLR_DEBUG,
+               "reused: texture %p gk %p lock & invalidate buffer %p [%zu]",
+               (void *)texture, (void *)texture->gk, texture->buffer,
+               texture->buffer->n_locks);
+#endif
+      return &texture->wlr_texture;
+    }
+  }
+  return NULL;
+}
+
+static struct wlr_texture *
+wxrd_texture_from_dmabuf_buffer (struct wxrd_renderer *renderer,
+                                 struct wlr_buffer *buffer,
+                                 struct wlr_dmabuf_attributes *dmabuf)
+{
+  TRACE_FN
+  // wlr_log (WLR_DEBUG, "wxrd_texture_from_dmabuf_buffer");
+  struct wlr_texture *wlr_texture = texture_lookup_buffer (renderer, buffer);
+  if (wlr_texture != NULL) {
+    return wlr_texture;
+  }
+
+  wlr_texture = wxrd_texture_from_dmabuf (&renderer->base, dmabuf);
+  if (wlr_texture == NULL) {
+    return false;
+  }
+
+  struct wxrd_texture *texture = wxrd_get_texture (wlr_texture);
 
   texture->buffer = wlr_buffer_lock (buffer);
 #ifdef DEBUG_BUFFER_LOCKS
@@ -907,6 +1198,677 @@ _buffer_end_data_ptr_access (struct wlr_buffer *buffer)
   buffer->accessing_data_ptr = false;
 }
 
+/* Imports a shm buffer whose pool was converted to a dmabuf right away.
+ * Later commits of the buffer find the texture in the buffer cache, the GPU
+ * samples the client's memory and nothing is ever uploaded. */
+static struct wlr_texture *
+wxrd_texture_from_udmabuf (struct wxrd_renderer *renderer,
+                           struct wlr_buffer *buffer,
+                           void *data,
+                           uint32_t drm_format)
+{
+  if (renderer->udmabuf == NULL || renderer->suspended) {
+    return NULL;
+  }
+
+  // udmabufs are always linear
+  if (!wlr_drm_format_set_has (get_supported_formats (renderer), drm_format,
+                               DRM_FORMAT_MOD_LINEAR)
+      || wlr_drm_format_set_has (&renderer->udmabuf_failed, drm_format,
+                                 DRM_FORMAT_MOD_LINEAR)) {
+    return NULL;
+  }
+
+  const struct wxrd_pixel_format *fmt = get_wxrd_format_from_drm (drm_format);
+  struct wlr_dmabuf_attributes attribs;
+  if (fmt == NULL
+      || !wxrd_udmabuf_get_attribs (renderer->udmabuf, data, &attribs)) {
+    return NULL;
+  }
+
+  struct wlr_texture *wlr_texture = NULL;
+  if (attribs.format == drm_format && attribs.width == buffer->width
+      && attribs.height == buffer->height) {
+    wlr_texture = wxrd_texture_from_dmabuf_buffer (renderer, buffer, &attribs);
+  }
+  if (wlr_texture == NULL) {
+    wlr_dmabuf_attributes_finish (&attribs);
+    return NULL;
+  }
+
+  struct wxrd_texture *texture = wxrd_get_texture (wlr_texture);
+  texture->has_alpha = fmt->has_alpha;
+
+  bool ok = texture_import_dmabuf (texture, &attribs);
+  // gulkan imports a dup of the fd
+  wlr_dmabuf_attributes_finish (&attribs);
+
+  if (!ok) {
+    wlr_log (WLR_INFO, "udmabuf import of format 0x%" PRIX32
+             " failed, uploading instead", drm_format);
+    wlr_drm_format_set_add (&renderer->udmabuf_failed, drm_format,
+                            DRM_FORMAT_MOD_LINEAR);
+    struct wlr_buffer *locked = texture->buffer;
+    wxrd_texture_destroy (texture);
+    wlr_buffer_unlock (locked);
+    return NULL;
+  }
+
+  wxrd_stats.buffers_udmabuf++;
+  return wlr_texture;
+}
+
+/* Keeps the shm buffer locked instead of uploading it. Only the newest
+ * buffer of a surface survives until wxrd_texture_latch, older ones are
+ * released to the client as soon as wlroots drops their texture. */
+static struct wlr_texture *
+wxrd_texture_from_shm_buffer (struct wxrd_renderer *renderer,
+                              struct wlr_buffer *buffer,
+                              uint32_t drm_format)
+{
+  const struct wxrd_pixel_format *fmt = get_wxrd_format_from_drm (drm_format);
+  if (fmt == NULL) {
+    wlr_log (WLR_ERROR, "Unsupported pixel format %" PRIu32, drm_format);
+    return NULL;
+  }
+
+  struct wxrd_texture *texture
+      = texture_create (renderer, buffer->width, buffer->height,
+                        fmt->drm_format, fmt->has_alpha);
+  if (texture == NULL) {
+    return NULL;
+  }
+
+  texture->pending_buffer = wlr_buffer_lock (buffer);
+
+  return &texture->wlr_texture;
+}
+
+/* Uploads a dmabuf the Vulkan device can't import like a shm buffer, from
+ * a CPU mapping. */
+static struct wlr_texture *
+wxrd_texture_from_mapped_dmabuf (struct wxrd_renderer *renderer,
+                                 struct wlr_buffer *buffer)
+{
+  struct wlr_buffer *mapped = wxrd_dmabuf_map_buffer_create (buffer);
+  if (mapped == NULL) {
+    return NULL;
+  }
+
+  struct wxrd_dmabuf_map_buffer *map_buffer
+      = wl_container_of (mapped, map_buffer, base);
+  struct wlr_texture *wlr_texture = wxrd_texture_from_shm_buffer (
+      renderer, mapped, map_buffer->attribs.format);
+  if (wlr_texture != NULL) {
+    wxrd_get_texture (wlr_texture)->mapped_dmabuf = true;
+  }
+
+  wlr_buffer_unlock (mapped);
+  return wlr_texture;
+}
+
+/* Clips the damage accumulated over several commits to the texture and
+ * reduces it to few rects. Overlapping damage was already unioned, so no
+ * pixel is uploaded twice. */
+static void
+texture_simplify_damage (struct wxrd_texture *texture,
+                         const pixman_region32_t *damage,
+                         pixman_region32_t *out)
+{
+  uint32_t width = texture->crop.width;
+  uint32_t height = texture->crop.height;
+
+  // damage outside of the crop is never uploaded
+  pixman_region32_copy (out, (pixman_region32_t *)damage);
+  pixman_region32_translate (out, -texture->crop.x, -texture->crop.y);
+  pixman_region32_intersect_rect (out, out, 0, 0, width, height);
+
+  int n_rects;
+  const pixman_box32_t *rects = pixman_region32_rectangles (out, &n_rects);
+  uint64_t area = 0;
+  for (int i = 0; i < n_rects; i++) {
+    area += (uint64_t)(rects[i].x2 - rects[i].x1) * (rects[i].y2 - rects[i].y1);
+  }
+
+  if (ALWAYS_UPLOAD_FULL_TEXTURES
+      || area * 100 > (uint64_t)width * height * FULL_UPLOAD_DAMAGE_PERCENT) {
+    // one big upload is cheaper than many almost full ones
+    pixman_region32_fini (out);
+    pixman_region32_init_rect (out, 0, 0, width, height);
+  } else if (n_rects > MAX_DAMAGE_RECTS) {
+    pixman_box32_t extents = *pixman_region32_extents (out);
+    pixman_region32_fini (out);
+    pixman_region32_init_rect (out, extents.x1, extents.y1,
+                               extents.x2 - extents.x1,
+                               extents.y2 - extents.y1);
+  }
+}
+
+static bool
+texture_can_reuse (struct wxrd_texture *texture,
+                   GulkanTexture *reuse,
+                   const pixman_region32_t *damage)
+{
+  // never write into a client's dmabuf
+  if (reuse == NULL || damage == NULL
+      || !wxrd_texture_pool_owns (&texture->renderer->texture_pool, reuse)) {
+    return false;
+  }
+
+  const struct wxrd_pixel_format *fmt
+      = get_wxrd_format_from_drm (texture->drm_format);
+  assert (fmt);
+
+  // the same texels of the buffer
+  const struct wlr_box *crop = g_object_get_data (G_OBJECT (reuse), crop_key);
+  return crop != NULL && crop->x == texture->crop.x
+         && crop->y == texture->crop.y && crop->width == texture->crop.width
+         && crop->height == texture->crop.height
+         && gulkan_texture_get_format (reuse) == fmt->vk_format;
+}
+
+/* Picks the shadow the pack stage refines upload_region with. A new shadow
+ * is filled from a full upload. */
+static void
+texture_setup_refine (struct wxrd_texture *texture,
+                      const struct wxrd_pixel_format *fmt)
+{
+  uint32_t width = texture->crop.width;
+  uint32_t height = texture->crop.height;
+
+  texture->upload_shadow = NULL;
+  texture->upload_shadow_fill = false;
+
+  struct wxrd_texture_shadow *shadow = NULL;
+  if (texture->upload_reuse != NULL) {
+    shadow = g_object_get_data (G_OBJECT (texture->upload_reuse), shadow_key);
+  }
+
+  if (!texture->refine_damage) {
+    // goes stale with this upload
+    if (shadow != NULL) {
+      g_object_set_data (G_OBJECT (texture->upload_reuse), shadow_key, NULL);
+    }
+    return;
+  }
+
+  if (shadow != NULL && shadow->width == width && shadow->height == height
+      && shadow->drm_format == texture->drm_format) {
+    texture->upload_shadow = shadow;
+    return;
+  }
+
+  uint32_t stride = width * (fmt->buffer_bpp / 8);
+  shadow = malloc (sizeof (*shadow) + (size_t)stride * height);
+  if (shadow == NULL) {
+    wlr_log (WLR_ERROR, "Allocation failed, not refining damage");
+    return;
+  }
+  shadow->width = width;
+  shadow->height = height;
+  shadow->drm_format = texture->drm_format;
+  shadow->stride = stride;
+
+  texture->upload_shadow = shadow;
+  texture->upload_shadow_fill = true;
+  pixman_region32_fini (&texture->upload_region);
+  pixman_region32_init_rect (&texture->upload_region, 0, 0, width, height);
+}
+
+/* Decides what to upload from the pending shm buffer. If reuse is the
+ * gulkan texture of the previous buffer of the same surface and still fits,
+ * only damage is uploaded into it instead of creating a new texture. */
+static void
+texture_setup_upload (struct wxrd_texture *texture,
+                      GulkanTexture *reuse,
+                      const pixman_region32_t *damage)
+{
+  uint32_t width = texture->crop.width;
+  uint32_t height = texture->crop.height;
+
+  if (texture_can_reuse (texture, reuse, damage)) {
+    texture->upload_reuse = reuse;
+    texture_simplify_damage (texture, damage, &texture->upload_region);
+  } else {
+    texture->upload_reuse = NULL;
+    pixman_region32_fini (&texture->upload_region);
+    pixman_region32_init_rect (&texture->upload_region, 0, 0, width, height);
+  }
+
+  const struct wxrd_pixel_format *fmt
+      = get_wxrd_format_from_drm (texture->drm_format);
+  assert (fmt);
+  texture_setup_refine (texture, fmt);
+
+  // the GPU would read a mapped dmabuf after its CPU access ended, can't
+  // convert formats while copying, and refining damage needs the CPU to
+  // read the buffer anyway
+  texture->upload_host = texture->renderer->transfer.host_import
+                         && !texture->mapped_dmabuf
+                         && fmt->conversion == WXRD_CONVERT_NONE
+                         && texture->upload_shadow == NULL
+                         && !wxrd_texture_is_cropped (texture);
+
+  const pixman_box32_t *extents
+      = pixman_region32_extents (&texture->upload_region);
+  texture->upload_full = pixman_region32_n_rects (&texture->upload_region) == 1
+                         && extents->x1 == 0 && extents->y1 == 0
+                         && extents->x2 == (int32_t)width
+                         && extents->y2 == (int32_t)height;
+
+  texture->upload_staging = NULL;
+  if (!texture->upload_host) {
+    VkDeviceSize size = 0;
+    int n_rects;
+    const pixman_box32_t *rects
+        = pixman_region32_rectangles (&texture->upload_region, &n_rects);
+    for (int i = 0; i < n_rects; i++) {
+      size += (VkDeviceSize)(rects[i].x2 - rects[i].x1)
+              * (rects[i].y2 - rects[i].y1) * (fmt->bpp / 8);
+    }
+    texture->upload_staging = wxrd_vk_transfer_stage (
+        &texture->renderer->transfer, size, &texture->upload_staging_offset);
+  }
+}
+
+static uint64_t
+region_area (const pixman_region32_t *region)
+{
+  int n_rects;
+  const pixman_box32_t *rects
+      = pixman_region32_rectangles ((pixman_region32_t *)region, &n_rects);
+  uint64_t area = 0;
+  for (int i = 0; i < n_rects; i++) {
+    area += (uint64_t)(rects[i].x2 - rects[i].x1) * (rects[i].y2 - rects[i].y1);
+  }
+  return area;
+}
+
+/* Shrinks upload_region to the tiles whose contents differ from the shadow
+ * and updates the shadow, or fills a new shadow from the whole buffer. */
+static void
+texture_refine_damage (struct wxrd_texture *texture,
+                       const uint8_t *data,
+                       size_t stride,
+                       uint32_t bytes_per_texel)
+{
+  struct wxrd_texture_shadow *shadow = texture->upload_shadow;
+  uint64_t damaged = region_area (&texture->upload_region);
+
+  if (texture->upload_shadow_fill) {
+    for (uint32_t y = 0; y < shadow->height; y++) {
+      memcpy (shadow->data + y * shadow->stride, data + y * stride,
+              shadow->stride);
+    }
+    texture->refine_damaged_pixels += damaged;
+    texture->refine_changed_pixels += damaged;
+    return;
+  }
+
+  // without staging every rect is a gulkan upload of its own, don't split
+  // the damage into tiles then but keep the shadow up to date
+  bool diff = texture->upload_staging != NULL;
+
+  pixman_region32_t changed;
+  pixman_region32_init (&changed);
+  int n_rects;
+  const pixman_box32_t *rects
+      = pixman_region32_rectangles (&texture->upload_region, &n_rects);
+  for (int i = 0; i < n_rects; i++) {
+    const pixman_box32_t *r = &rects[i];
+    for (int32_t ty = r->y1 / REFINE_TILE_SIZE * REFINE_TILE_SIZE;
+         ty < r->y2; ty += REFINE_TILE_SIZE) {
+      for (int32_t tx = r->x1 / REFINE_TILE_SIZE * REFINE_TILE_SIZE;
+           tx < r->x2; tx += REFINE_TILE_SIZE) {
+        // the tile clipped to the rect
+        int32_t x1 = MAX (tx, r->x1);
+        int32_t y1 = MAX (ty, r->y1);
+        int32_t x2 = MIN (tx + REFINE_TILE_SIZE, r->x2);
+        int32_t y2 = MIN (ty + REFINE_TILE_SIZE, r->y2);
+        size_t row_size = (size_t)(x2 - x1) * bytes_per_texel;
+        const uint8_t *src = data + y1 * stride + x1 * bytes_per_texel;
+        uint8_t *dst
+            = shadow->data + y1 * shadow->stride + x1 * bytes_per_texel;
+
+        bool differs = !diff;
+        for (int32_t y = y1; y < y2 && !differs; y++) {
+          differs = memcmp (src + (y - y1) * stride,
+                            dst + (y - y1) * shadow->stride, row_size)
+                    != 0;
+        }
+        if (!differs) {
+          continue;
+        }
+
+        for (int32_t y = y1; y < y2; y++) {
+          memcpy (dst + (y - y1) * shadow->stride, src + (y - y1) * stride,
+                  row_size);
+        }
+        pixman_region32_union_rect (&changed, &changed, x1, y1, x2 - x1,
+                                    y2 - y1);
+      }
+    }
+  }
+
+  uint64_t changed_pixels = region_area (&changed);
+  texture->refine_damaged_pixels += damaged;
+  texture->refine_changed_pixels += changed_pixels;
+
+  if (changed_pixels != damaged) {
+    pixman_region32_copy (&texture->upload_region, &changed);
+    texture->upload_full = false;
+  }
+  pixman_region32_fini (&changed);
+}
+
+/* CPU stage of a deferred shm upload: packs the rects of upload_region
+ * tightly one after another into the staging ring, or into region_data the
+ * way gulkan expects them.
+ * Only touches the texture and its pending buffer, so textures of different
+ * views are packed concurrently on the pack pool. */
+static void
+texture_pack_pending_buffer (struct wxrd_texture *texture)
+{
+  struct wlr_buffer *buffer = texture->pending_buffer;
+
+  // nothing to do on the CPU if the GPU can read the client's memory
+  if (texture->upload_host) {
+    texture->upload_state = WXRD_UPLOAD_PACKED;
+    return;
+  }
+
+  void *data;
+  uint32_t format;
+  size_t stride;
+  // shm access guards against SIGBUS per thread, so this is fine on workers
+  if (!_buffer_begin_data_ptr_access (buffer, &data, &format, &stride)) {
+    wlr_log (WLR_ERROR, "Failed to access deferred shm buffer");
+    texture->upload_state = WXRD_UPLOAD_FAILED;
+    return;
+  }
+
+  const struct wxrd_pixel_format *fmt
+      = get_wxrd_format_from_drm (texture->drm_format);
+  assert (fmt);
+  uint32_t bytes_per_texel = fmt->bpp / 8;
+  uint32_t buffer_bytes_per_texel = fmt->buffer_bpp / 8;
+  uint32_t packed_stride = texture->crop.width * bytes_per_texel;
+  // upload_region is relative to the crop
+  const uint8_t *crop_data = (uint8_t *)data + stride * texture->crop.y
+                             + texture->crop.x * buffer_bytes_per_texel;
+
+  if (texture->upload_shadow != NULL) {
+    texture_refine_damage (texture, crop_data, stride,
+                           buffer_bytes_per_texel);
+  }
+
+  // full and already packed buffers are uploaded straight from the buffer
+  if (texture->upload_staging == NULL && texture->upload_full
+      && stride == packed_stride && fmt->conversion == WXRD_CONVERT_NONE
+      && !wxrd_texture_is_cropped (texture)) {
+    texture->upload_packed = false;
+  } else {
+    if (texture->upload_staging == NULL && texture->region_data == NULL) {
+      texture->region_data
+          = malloc ((size_t)packed_stride * texture->crop.height);
+      if (texture->region_data == NULL) {
+        wlr_log (WLR_ERROR, "Failed to allocate the packed damage");
+        _buffer_end_data_ptr_access (buffer);
+        texture->upload_state = WXRD_UPLOAD_FAILED;
+        return;
+      }
+    }
+
+    uint8_t *dst = texture->upload_staging != NULL ? texture->upload_staging
+                                                   : texture->region_data;
+    int n_rects;
+    const pixman_box32_t *rects
+        = pixman_region32_rectangles (&texture->upload_region, &n_rects);
+    for (int i = 0; i < n_rects; i++) {
+      const pixman_box32_t *r = &rects[i];
+      uint32_t row_size = (r->x2 - r->x1) * bytes_per_texel;
+      const uint8_t *src
+          = crop_data + stride * r->y1 + r->x1 * buffer_bytes_per_texel;
+      for (int32_t y = r->y1; y < r->y2; y++) {
+        if (fmt->conversion != WXRD_CONVERT_NONE) {
+          // not streamed, the conversion writes whole texels anyway
+          wxrd_convert_row (fmt->conversion, dst, src, r->x2 - r->x1);
+        } else if (texture->upload_staging != NULL) {
+          wxrd_vk_transfer_write_staged (&texture->renderer->transfer, dst,
+                                         src, row_size);
+        } else {
+          memcpy (dst, src, row_size);
+        }
+        dst += row_size;
+        src += stride;
+      }
+    }
+    texture->upload_packed = true;
+  }
+
+  _buffer_end_data_ptr_access (buffer);
+  texture->upload_state = WXRD_UPLOAD_PACKED;
+}
+
+static void
+pack_pool_func (gpointer data, gpointer user_data)
+{
+  struct wxrd_texture *texture = data;
+  struct wxrd_renderer *renderer = user_data;
+
+  texture_pack_pending_buffer (texture);
+
+  g_mutex_lock (&renderer->pack_mutex);
+  texture->packing = false;
+  g_cond_broadcast (&renderer->pack_cond);
+  g_mutex_unlock (&renderer->pack_mutex);
+}
+
+static void
+texture_wait_packed (struct wxrd_texture *texture)
+{
+  struct wxrd_renderer *renderer = texture->renderer;
+  g_mutex_lock (&renderer->pack_mutex);
+  while (texture->packing) {
+    g_cond_wait (&renderer->pack_cond, &renderer->pack_mutex);
+  }
+  g_mutex_unlock (&renderer->pack_mutex);
+}
+
+static void
+texture_count_upload (struct wxrd_texture *texture)
+{
+  int n_rects;
+  const pixman_box32_t *rects
+      = pixman_region32_rectangles (&texture->upload_region, &n_rects);
+  for (int i = 0; i < n_rects; i++) {
+    wxrd_stats.damage_pixels_uploaded += (uint64_t)(rects[i].x2 - rects[i].x1)
+                                         * (rects[i].y2 - rects[i].y1);
+  }
+  wxrd_stats.damage_uploads += n_rects;
+  wxrd_stats.buffers_latched++;
+  wxrd_stats.buffers_uploaded++;
+}
+
+/* Copies upload_region straight from the client's shm pool on the GPU.
+ * The buffer stays locked until the copy finished. */
+static bool
+texture_upload_host (struct wxrd_texture *texture)
+{
+  struct wlr_buffer *buffer = texture->pending_buffer;
+
+  void *data;
+  uint32_t format;
+  size_t stride;
+  if (!_buffer_begin_data_ptr_access (buffer, &data, &format, &stride)) {
+    return false;
+  }
+
+  const struct wxrd_pixel_format *fmt
+      = get_wxrd_format_from_drm (texture->drm_format);
+  assert (fmt);
+  G3kContext *g3k = xrd_shell_get_g3k (texture->renderer->xrd_shell);
+  VkImageLayout layout = g3k_context_get_upload_layout (g3k);
+  // a new texture's contents are replaced completely
+  VkImageLayout old_layout
+      = texture->upload_reuse != NULL ? layout : VK_IMAGE_LAYOUT_UNDEFINED;
+
+  int n_rects;
+  const pixman_box32_t *rects
+      = pixman_region32_rectangles (&texture->upload_region, &n_rects);
+  bool ok = wxrd_vk_transfer_copy_from_host (
+      &texture->renderer->transfer, texture->gk, old_layout, layout, buffer,
+      data, stride, texture->wlr_texture.height, fmt->bpp / 8, rects, n_rects);
+
+  _buffer_end_data_ptr_access (buffer);
+
+  return ok;
+}
+
+/* GPU stage of a deferred shm upload, on the render side. Returns whether
+ * the texture holds the buffer's contents. */
+static bool
+texture_upload_packed (struct wxrd_texture *texture)
+{
+  struct wlr_buffer *buffer = texture->pending_buffer;
+
+  if (texture->upload_host) {
+    if (texture_upload_host (texture)) {
+      wxrd_stats.buffers_host_imported++;
+      texture_count_upload (texture);
+      return true;
+    }
+    // e.g. unaligned pool, copy on the CPU instead
+    texture->upload_host = false;
+    texture_pack_pending_buffer (texture);
+    if (texture->upload_state != WXRD_UPLOAD_PACKED) {
+      return false;
+    }
+  }
+
+  // refined damage that didn't change anything
+  if (!pixman_region32_not_empty (&texture->upload_region)) {
+    texture_count_upload (texture);
+    return true;
+  }
+
+  const struct wxrd_pixel_format *fmt
+      = get_wxrd_format_from_drm (texture->drm_format);
+  assert (fmt);
+  uint32_t bytes_per_texel = fmt->bpp / 8;
+  G3kContext *g3k = xrd_shell_get_g3k (texture->renderer->xrd_shell);
+  VkImageLayout layout = g3k_context_get_upload_layout (g3k);
+
+  if (texture->upload_staging != NULL) {
+    VkImageLayout old_layout
+        = texture->upload_reuse != NULL ? layout : VK_IMAGE_LAYOUT_UNDEFINED;
+    int n_rects;
+    const pixman_box32_t *rects
+        = pixman_region32_rectangles (&texture->upload_region, &n_rects);
+    if (!wxrd_vk_transfer_copy_staged (
+            &texture->renderer->transfer, texture->gk, old_layout, layout,
+            texture->upload_staging_offset, bytes_per_texel, rects,
+            n_rects)) {
+      return false;
+    }
+    for (int i = 0; i < n_rects; i++) {
+      wxrd_stats.upload_bytes += (uint64_t)(rects[i].x2 - rects[i].x1)
+                                 * (rects[i].y2 - rects[i].y1)
+                                 * bytes_per_texel;
+    }
+  } else if (!texture->upload_packed) {
+    void *data;
+    uint32_t format;
+    size_t stride;
+    if (!_buffer_begin_data_ptr_access (buffer, &data, &format, &stride)) {
+      return false;
+    }
+    bool uploaded = texture_upload_full (texture, data, stride);
+    _buffer_end_data_ptr_access (buffer);
+    if (!uploaded) {
+      return false;
+    }
+  } else if (texture->upload_full) {
+    gsize size = (gsize)texture->crop.width * texture->crop.height
+                 * bytes_per_texel;
+    gulkan_texture_upload_pixels (texture->gk, texture->region_data, size,
+                                  layout);
+    wxrd_stats.upload_bytes += size;
+  } else {
+    uint8_t *region_ptr = texture->region_data;
+    int n_rects;
+    const pixman_box32_t *rects
+        = pixman_region32_rectangles (&texture->upload_region, &n_rects);
+    for (int i = 0; i < n_rects; i++) {
+      const pixman_box32_t *r = &rects[i];
+      // the texel offset and extent of the region in the full texture
+      VkOffset2D offset = { .x = r->x1, .y = r->y1 };
+      VkExtent2D extent
+          = { .width = r->x2 - r->x1, .height = r->y2 - r->y1 };
+      gsize region_size = extent.width * extent.height * bytes_per_texel;
+
+      gulkan_texture_upload_pixels_region (texture->gk, region_ptr,
+                                           region_size, layout, offset,
+                                           extent);
+      wxrd_stats.upload_bytes += region_size;
+
+#ifdef SAVE_UPDATED_TEXTURE_REGION
+      {
+        static int n = 0;
+        save_texture ("updated_texture_region", n++, region_ptr, extent.width,
+                      extent.height, extent.width * bytes_per_texel);
+      }
+#endif
+
+      region_ptr += region_size;
+    }
+  }
+
+  texture_count_upload (texture);
+  return true;
+}
+
+static bool
+texture_upload_pending_buffer (struct wxrd_texture *texture)
+{
+  if (texture->upload_state == WXRD_UPLOAD_PACKED) {
+    int64_t start_ns = get_now_ns ();
+    if (texture->upload_reuse != NULL) {
+      texture->gk = g_object_ref (texture->upload_reuse);
+    } else {
+      texture_create_gk (texture);
+    }
+
+    bool uploaded = texture->gk != NULL && texture_upload_packed (texture);
+    wxrd_stats.upload_ns += get_now_ns () - start_ns;
+
+    if (texture->upload_shadow_fill && uploaded) {
+      g_object_set_data_full (G_OBJECT (texture->gk), shadow_key,
+                              texture->upload_shadow, free);
+      texture->upload_shadow_fill = false;
+    } else if (texture->upload_shadow != NULL && !uploaded
+               && texture->gk != NULL) {
+      // the shadow is ahead of the texture contents now
+      g_object_set_data (G_OBJECT (texture->gk), shadow_key, NULL);
+    }
+  }
+
+  if (texture->upload_shadow_fill) {
+    free (texture->upload_shadow);
+  }
+  texture->upload_shadow = NULL;
+  texture->upload_shadow_fill = false;
+  texture->upload_state = WXRD_UPLOAD_NONE;
+  texture->upload_reuse = NULL;
+  texture->upload_staging = NULL;
+
+  struct wlr_buffer *buffer = texture->pending_buffer;
+  texture->pending_buffer = NULL;
+  wlr_buffer_unlock (buffer);
+
+  return texture->gk != NULL;
+}
+
 struct wlr_texture *
 wxrd_texture_from_buffer (struct wlr_renderer *wlr_renderer,
                           struct wlr_buffer *buffer)
@@ -919,12 +1881,31 @@ wxrd_texture_from_buffer (struct wlr_renderer *wlr_renderer,
   size_t stride;
   struct wlr_dmabuf_attributes dmabuf;
   if (wlr_buffer_get_dmabuf (buffer, &dmabuf)) {
-    return wxrd_texture_from_dmabuf_buffer (renderer, buffer, &dmabuf);
+    // imports of this format and modifier failed before
+    if (wlr_drm_format_set_has (&renderer->dmabuf_failed, dmabuf.format,
+                                dmabuf.modifier)) {
+      return wxrd_texture_from_mapped_dmabuf (renderer, buffer);
+    }
+
+    struct wlr_texture *wlr_texture
+        = wxrd_texture_from_dmabuf_buffer (renderer, buffer, &dmabuf);
+    if (wlr_texture != NULL) {
+      texture_lookup_import (wxrd_get_texture (wlr_texture), &dmabuf);
+      texture_start_import (wxrd_get_texture (wlr_texture), &dmabuf);
+    }
+    return wlr_texture;
   } else if (_buffer_begin_data_ptr_access (buffer, &data, &format, &stride)) {
-    struct wlr_texture *tex = wxrd_texture_from_pixels (
-        wlr_renderer, format, stride, buffer->width, buffer->height, data);
     _buffer_end_data_ptr_access (buffer);
-    return tex;
+
+    // shm buffer converted to a dmabuf earlier
+    struct wlr_texture *wlr_texture = texture_lookup_buffer (renderer, buffer);
+    if (wlr_texture == NULL) {
+      wlr_texture = wxrd_texture_from_udmabuf (renderer, buffer, data, format);
+    }
+    if (wlr_texture != NULL) {
+      return wlr_texture;
+    }
+    return wxrd_texture_from_shm_buffer (renderer, buffer, format);
   } else {
     wlr_log (WLR_ERROR, "buffer is neither dma buf nor pixel buffer");
     return NULL;
@@ -934,6 +1915,274 @@ wxrd_texture_from_buffer (struct wlr_renderer *wlr_renderer,
   return NULL;
 }
 
+/* Imports the dmabuf of a texture, or takes the result of its import */
+static bool
+texture_latch_dmabuf (struct wxrd_texture *texture)
+{
+  if (texture->import != NULL) {
+    return g_atomic_int_get (&texture->import->done)
+           && texture_finish_import (texture);
+  }
+
+  struct wlr_dmabuf_attributes dmabuf;
+  return texture->buffer != NULL
+         && wlr_buffer_get_dmabuf (texture->buffer, &dmabuf)
+         && texture_import_dmabuf (texture, &dmabuf);
+}
+
+/* Uploads the dmabuf of a texture through a CPU mapping after its import
+ * failed, so the window stays visible. Later buffers of the same format and
+ * modifier skip the import. */
+static bool
+texture_map_failed_dmabuf (struct wxrd_texture *texture)
+{
+  struct wxrd_renderer *renderer = texture->renderer;
+  struct wlr_dmabuf_attributes dmabuf;
+  if (texture->buffer == NULL
+      || !wlr_buffer_get_dmabuf (texture->buffer, &dmabuf)) {
+    return false;
+  }
+
+  if (!wlr_drm_format_set_has (&renderer->dmabuf_failed, dmabuf.format,
+                               dmabuf.modifier)) {
+    wlr_log (WLR_INFO,
+             "dmabuf import of format 0x%" PRIX32 " modifier 0x%" PRIX64
+             " failed, %s",
+             dmabuf.format, dmabuf.modifier,
+             wxrd_dmabuf_map_supported (&dmabuf) ? "uploading instead"
+                                                 : "can't map it");
+    wlr_drm_format_set_add (&renderer->dmabuf_failed, dmabuf.format,
+                            dmabuf.modifier);
+  }
+
+  const struct wxrd_pixel_format *fmt = get_wxrd_format_from_drm (dmabuf.format);
+  if (fmt == NULL) {
+    return false;
+  }
+  struct wlr_buffer *mapped = wxrd_dmabuf_map_buffer_create (texture->buffer);
+  if (mapped == NULL) {
+    return false;
+  }
+
+  texture->drm_format = fmt->drm_format;
+  texture->has_alpha = fmt->has_alpha;
+  texture->mapped_dmabuf = true;
+  // the gulkan texture will come from the texture pool
+  texture->has_dmabuf_key = false;
+  texture->pending_buffer = mapped;
+  return true;
+}
+
+uint64_t
+wxrd_texture_latch_cost (struct wxrd_texture *texture,
+                         GulkanTexture *reuse,
+                         const pixman_region32_t *damage)
+{
+  if (texture->gk != NULL || texture->pending_buffer == NULL) {
+    return 0;
+  }
+
+  const struct wxrd_pixel_format *fmt
+      = get_wxrd_format_from_drm (texture->drm_format);
+  assert (fmt);
+  uint64_t bytes_per_texel = fmt->bpp / 8;
+
+  if (!texture_can_reuse (texture, reuse, damage)) {
+    return bytes_per_texel * texture->crop.width * texture->crop.height;
+  }
+
+  pixman_region32_t upload;
+  pixman_region32_init (&upload);
+  texture_simplify_damage (texture, damage, &upload);
+
+  int n_rects;
+  const pixman_box32_t *rects = pixman_region32_rectangles (&upload, &n_rects);
+  uint64_t bytes = 0;
+  for (int i = 0; i < n_rects; i++) {
+    bytes += bytes_per_texel * (rects[i].x2 - rects[i].x1)
+             * (rects[i].y2 - rects[i].y1);
+  }
+
+  pixman_region32_fini (&upload);
+  return bytes;
+}
+
+void
+wxrd_texture_latch_prepare (struct wxrd_texture *texture,
+                            GulkanTexture *reuse,
+                            const pixman_region32_t *damage)
+{
+  struct wxrd_renderer *renderer = texture->renderer;
+
+  if (texture->gk != NULL || texture->pending_buffer == NULL
+      || texture->upload_state != WXRD_UPLOAD_NONE || renderer->suspended) {
+    return;
+  }
+
+  texture_setup_upload (texture, reuse, damage);
+  texture->upload_state = WXRD_UPLOAD_QUEUED;
+
+  // not worth a thread hop
+  uint64_t area = (uint64_t)texture->crop.width * texture->crop.height;
+  if (renderer->pack_pool == NULL
+      || (texture->upload_full && area < PACK_POOL_MIN_TEXELS)) {
+    texture_pack_pending_buffer (texture);
+    return;
+  }
+
+  texture->packing = true;
+  g_thread_pool_push (renderer->pack_pool, texture, NULL);
+}
+
+bool
+wxrd_texture_latch (struct wxrd_texture *texture,
+                    GulkanTexture *reuse,
+                    const pixman_region32_t *damage)
+{
+  if (texture->gk != NULL) {
+    if (texture->dmabuf_acquire) {
+      texture_acquire_dmabuf (texture,
+                              VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    }
+    return true;
+  }
+
+  if (texture->renderer->suspended) {
+    return false;
+  }
+
+  if (texture->pending_buffer == NULL) {
+    if (texture_latch_dmabuf (texture)) {
+      wxrd_stats.buffers_latched++;
+      return true;
+    }
+    // the view keeps its previous texture until the import is done
+    if (wxrd_texture_importing (texture)
+        || !texture_map_failed_dmabuf (texture)) {
+      return false;
+    }
+  }
+
+  if (texture->upload_state == WXRD_UPLOAD_NONE) {
+    wxrd_texture_latch_prepare (texture, reuse, damage);
+  }
+  texture_wait_packed (texture);
+  return texture_upload_pending_buffer (texture);
+}
+
+void
+wxrd_texture_set_crop (struct wxrd_texture *texture,
+                       const struct wlr_box *crop)
+{
+  if (texture->gk != NULL || texture->pending_buffer == NULL
+      || texture->upload_state != WXRD_UPLOAD_NONE) {
+    return;
+  }
+
+  int width = texture->wlr_texture.width;
+  int height = texture->wlr_texture.height;
+  if (crop == NULL || crop->width <= 0 || crop->height <= 0 || crop->x < 0
+      || crop->y < 0 || crop->x + crop->width > width
+      || crop->y + crop->height > height) {
+    texture->crop = (struct wlr_box){ 0, 0, width, height };
+    return;
+  }
+  texture->crop = *crop;
+}
+
+bool
+wxrd_texture_is_cropped (struct wxrd_texture *texture)
+{
+  return texture->crop.x != 0 || texture->crop.y != 0
+         || texture->crop.width != (int)texture->wlr_texture.width
+         || texture->crop.height != (int)texture->wlr_texture.height;
+}
+
+struct wlr_buffer *
+wxrd_texture_lock_sampled_buffer (struct wxrd_texture *texture)
+{
+  if (texture->buffer == NULL || texture->gk == NULL
+      || wxrd_texture_pool_owns (&texture->renderer->texture_pool,
+                                 texture->gk)) {
+    return NULL;
+  }
+  return wlr_buffer_lock (texture->buffer);
+}
+
+bool
+wxrd_texture_importing (struct wxrd_texture *texture)
+{
+  return texture->gk == NULL && texture->import != NULL
+         && !g_atomic_int_get (&texture->import->done);
+}
+
+void
+wxrd_renderer_flush_uploads (struct wlr_renderer *wlr_renderer)
+{
+  struct wxrd_renderer *renderer = wxrd_get_renderer (wlr_renderer);
+  wxrd_vk_transfer_flush (&renderer->transfer);
+}
+
+void
+wxrd_renderer_retire_uploads (struct wlr_renderer *wlr_renderer)
+{
+  struct wxrd_renderer *renderer = wxrd_get_renderer (wlr_renderer);
+  wxrd_vk_transfer_retire (&renderer->transfer);
+  wxrd_texture_pool_frame_start (&renderer->texture_pool);
+  wxrd_dmabuf_cache_expire (&renderer->dmabuf_cache, get_now_ns ());
+}
+
+void
+wxrd_renderer_hold_texture (struct wlr_renderer *wlr_renderer,
+                            GulkanTexture *gk)
+{
+  struct wxrd_renderer *renderer = wxrd_get_renderer (wlr_renderer);
+  wxrd_texture_pool_release (&renderer->texture_pool, g_object_ref (gk));
+}
+
+void
+wxrd_renderer_hold_buffer (struct wlr_renderer *wlr_renderer,
+                           struct wlr_buffer *buffer)
+{
+  if (buffer == NULL) {
+    return;
+  }
+  struct wxrd_renderer *renderer = wxrd_get_renderer (wlr_renderer);
+
+  // The client may write the dmabuf again once it got it back, the next
+  // latch of the buffer has to acquire it from the client.
+  struct wxrd_texture *texture = texture_find_buffer (renderer, buffer);
+  if (texture != NULL && texture->gk != NULL && !texture->dmabuf_acquire
+      && !wxrd_texture_pool_owns (&renderer->texture_pool, texture->gk)) {
+    wxrd_vk_transfer_release_external (
+        &renderer->transfer, texture->gk,
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    texture->dmabuf_acquire = true;
+  }
+
+  wxrd_texture_pool_release_buffer (&renderer->texture_pool, buffer);
+}
+
+void
+wxrd_renderer_set_suspended (struct wlr_renderer *wlr_renderer,
+                             bool suspended)
+{
+  struct wxrd_renderer *renderer = wxrd_get_renderer (wlr_renderer);
+  if (renderer->suspended == suspended) {
+    return;
+  }
+  wlr_log (WLR_DEBUG, "%s uploads", suspended ? "Suspending" : "Resuming");
+  renderer->suspended = suspended;
+}
+
+void
+wxrd_renderer_set_udmabuf (struct wlr_renderer *wlr_renderer,
+                           struct wxrd_udmabuf *udmabuf)
+{
+  struct wxrd_renderer *renderer = wxrd_get_renderer (wlr_renderer);
+  renderer->udmabuf = udmabuf;
+}
+
 static bool
 wxrd_bind_buffer (struct wlr_renderer *wlr_renderer,
                   struct wlr_buffer *wlr_buffer)
@@ -1029,9 +2278,40 @@ wxrd_renderer_create (GulkanClient *gc)
 
   wlr_renderer_init (&renderer->base, &renderer_impl);
 
+  wxrd_convert_init ();
+  wxrd_texture_pool_init (&renderer->texture_pool, gc);
+  wxrd_dmabuf_cache_init (&renderer->dmabuf_cache, &renderer->texture_pool);
+
+  if (!wxrd_vk_transfer_init (&renderer->transfer, gc)) {
+    wlr_log (WLR_ERROR, "Vulkan transfer init failed, using gulkan uploads");
+  } else if (getenv ("WXRD_UPLOAD_BENCHMARK") != NULL) {
+    wxrd_vk_transfer_benchmark (&renderer->transfer, gc);
+  }
+
   wl_list_init (&renderer->buffers);
   wl_list_init (&renderer->textures);
 
+  g_mutex_init (&renderer->pack_mutex);
+  g_cond_init (&renderer->pack_cond);
+  int n_threads = MIN (g_get_num_processors (), PACK_POOL_MAX_THREADS);
+  if (n_threads > 1) {
+    GError *error = NULL;
+    renderer->pack_pool = g_thread_pool_new (pack_pool_func, renderer,
+                                             n_threads, FALSE, &error);
+    if (renderer->pack_pool == NULL) {
+      wlr_log (WLR_ERROR, "Failed to create pack pool: %s", error->message);
+      g_error_free (error);
+    }
+  }
+
+  GError *error = NULL;
+  renderer->import_pool = g_thread_pool_new (
+      import_pool_func, renderer, IMPORT_POOL_THREADS, FALSE, &error);
+  if (renderer->import_pool == NULL) {
+    wlr_log (WLR_ERROR, "Failed to create import pool: %s", error->message);
+    g_error_free (error);
+  }
+
   return &renderer->base;
 }
 
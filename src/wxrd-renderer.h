@@ -10,21 +10,30 @@
 #ifndef WXRD_RENDER_H
 #define WXRD_RENDER_H
 
+#include <pixman.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 #include <wlr/backend.h>
+#include <wlr/render/dmabuf.h>
 #include <wlr/render/egl.h>
 #include <wlr/render/gles2.h>
 #include <wlr/render/interface.h>
 #include <wlr/render/wlr_renderer.h>
 #include <wlr/render/wlr_texture.h>
+#include <wlr/util/box.h>
 #include <wlr/util/log.h>
 
 #include "GLES2/gl2ext.h"
 
 #include <xrd.h>
 
+#include "convert.h"
+#include "dmabuf-cache.h"
+#include "texture-pool.h"
+#include "udmabuf.h"
+#include "vk-transfer.h"
+
 // VkFormat
 #include "vulkan/vulkan_core.h"
 
@@ -34,6 +43,19 @@ struct wxrd_pixel_format
   VkFormat vk_format;
   int depth, bpp;
   bool has_alpha;
+  // bits per texel in client buffers, converted to bpp while packing
+  int buffer_bpp;
+  enum wxrd_conversion conversion;
+};
+
+enum wxrd_upload_state
+{
+  WXRD_UPLOAD_NONE,
+  // set up, packing on the calling thread or the pack pool
+  WXRD_UPLOAD_QUEUED,
+  // packed into region_data, ready for the GPU upload
+  WXRD_UPLOAD_PACKED,
+  WXRD_UPLOAD_FAILED,
 };
 
 struct wxrd_renderer
@@ -50,6 +72,49 @@ struct wxrd_renderer
   XrdShell *xrd_shell;
 
   int drm_fd;
+
+  // the XR runtime is not rendering, don't latch any uploads or imports
+  bool suspended;
+
+  // packs shm damage of several views concurrently, NULL on single core
+  GThreadPool *pack_pool;
+  // guards wxrd_texture.packing
+  GMutex pack_mutex;
+  GCond pack_cond;
+
+  // imports dmabufs off the commit path, NULL to import at the latch
+  GThreadPool *import_pool;
+
+  struct wxrd_vk_transfer transfer;
+  struct wxrd_texture_pool texture_pool;
+  struct wxrd_dmabuf_cache dmabuf_cache;
+
+  // shm pools convertible to dmabufs, NULL to always upload shm buffers
+  struct wxrd_udmabuf *udmabuf;
+  // formats whose linear udmabuf import failed, (format, LINEAR) pairs
+  struct wlr_drm_format_set udmabuf_failed;
+  // (format, modifier) pairs whose dmabuf import failed, mapped and
+  // uploaded instead
+  struct wlr_drm_format_set dmabuf_failed;
+};
+
+struct wxrd_texture_shadow;
+
+/* A dmabuf import running on the import pool. Shared by the texture and
+ * the worker, the worker publishes gk by setting done, without a lock. */
+struct wxrd_dmabuf_import
+{
+  struct wlr_dmabuf_attributes attribs; // fds owned by the import
+  GulkanClient *client;
+  int64_t start_ns;
+
+  // written by the worker before done is set
+  GulkanTexture *gk;
+  int64_t import_ns; // CPU time of the import
+  int64_t done_ns;
+
+  gint done;
+  gint ref_count;
 };
 
 struct wxrd_texture
@@ -69,6 +134,56 @@ struct wxrd_texture
   struct wlr_buffer *buffer;
   struct wl_listener buffer_destroy;
 
+  // identity of the client dmabuf gk was imported from
+  struct wxrd_dmabuf_key dmabuf_key;
+  bool has_dmabuf_key;
+  // gk was released to the client's queue family, by
+  // wxrd_renderer_hold_buffer or before it was put into the dmabuf cache,
+  // and has to be acquired again before it is sampled
+  bool dmabuf_acquire;
+
+  // dmabuf import started at commit, NULL once its result was latched
+  struct wxrd_dmabuf_import *import;
+  // commit to import done of the latched import, 0 once it was accounted
+  int64_t import_latency_ns;
+
+  // shm buffer whose upload is deferred to wxrd_texture_latch
+  struct wlr_buffer *pending_buffer;
+  // rect of the shm buffer gk holds, the whole buffer unless set with
+  // wxrd_texture_set_crop
+  struct wlr_box crop;
+  // pending_buffer is a struct wxrd_dmabuf_map_buffer
+  bool mapped_dmabuf;
+
+  // the deferred upload of pending_buffer
+  enum wxrd_upload_state upload_state;
+  // a pack pool worker owns the upload fields
+  bool packing;
+  // upload into the previous buffer's texture instead of a new one
+  GulkanTexture *upload_reuse;
+  pixman_region32_t upload_region;
+  bool upload_full;
+  // upload_region was copied to region_data, else upload from the buffer
+  bool upload_packed;
+  // try to let the GPU copy straight from the client's shm pool
+  bool upload_host;
+  // upload_region is packed into the transfer staging ring at this offset
+  // instead of region_data, NULL if the ring was full
+  uint8_t *upload_staging;
+  VkDeviceSize upload_staging_offset;
+
+  // diff upload_region against the shadow copy of the texture contents and
+  // only upload the tiles that changed, set before latching
+  bool refine_damage;
+  // the shadow diffed against, owned by the texture until it is attached to
+  // gk if upload_shadow_fill, i.e. it is new and filled instead of diffed
+  struct wxrd_texture_shadow *upload_shadow;
+  bool upload_shadow_fill;
+  // damaged and really changed pixels of refined uploads since the caller
+  // last reset them
+  uint64_t refine_damaged_pixels;
+  uint64_t refine_changed_pixels;
+
   struct wl_list link; // wlr_gles2_renderer.textures
 };
 
@@ -102,4 +217,86 @@ wxrd_texture_from_dmabuf (struct wlr_renderer *wlr_renderer,
 struct wlr_renderer *
 wxrd_renderer_create (GulkanClient *gc);
 
+void
+wxrd_renderer_set_suspended (struct wlr_renderer *wlr_renderer,
+                             bool suspended);
+
+/* Imports shm buffers of pools udmabuf converted instead of uploading
+ * them, NULL to stop. */
+void
+wxrd_renderer_set_udmabuf (struct wlr_renderer *wlr_renderer,
+                           struct wxrd_udmabuf *udmabuf);
+
+/* Submits the uploads latched since the last flush. Call it after latching
+ * and before the textures are rendered. */
+void
+wxrd_renderer_flush_uploads (struct wlr_renderer *wlr_renderer);
+
+/* Releases client buffers whose GPU copies finished, and gulkan textures the
+ * XR frames no longer sample. Called once per frame. */
+void
+wxrd_renderer_retire_uploads (struct wlr_renderer *wlr_renderer);
+
+/* Keeps a reference to gk until the XR frames in flight, which may sample
+ * it, completed. Call it before xrdesktop drops its reference to a texture
+ * by submitting another one. */
+void
+wxrd_renderer_hold_texture (struct wlr_renderer *wlr_renderer,
+                            GulkanTexture *gk);
+
+/* Takes over a lock of a buffer from wxrd_texture_lock_sampled_buffer and
+ * releases it to the client once the XR frames in flight completed. Call it
+ * when a texture stops being shown, its dmabuf is released to the client's
+ * queue family right away. buffer may be NULL. */
+void
+wxrd_renderer_hold_buffer (struct wlr_renderer *wlr_renderer,
+                           struct wlr_buffer *buffer);
+
+/* Creates the gulkan texture of a texture whose upload or import was
+ * deferred. Returns false if the texture has no usable gulkan texture.
+ * reuse: optional gulkan texture of the surface's previous buffer, only the
+ * damage (buffer coordinates) is uploaded into it if it still fits. */
+bool
+wxrd_texture_latch (struct wxrd_texture *texture,
+                    GulkanTexture *reuse,
+                    const pixman_region32_t *damage);
+
+/* Bytes wxrd_texture_latch would upload with the same arguments, 0 if
+ * nothing has to be uploaded. */
+uint64_t
+wxrd_texture_latch_cost (struct wxrd_texture *texture,
+                         GulkanTexture *reuse,
+                         const pixman_region32_t *damage);
+
+/* Starts the CPU work of the upload wxrd_texture_latch will do with the
+ * same arguments, possibly on another thread. Call it for all textures of a
+ * frame before latching them. */
+void
+wxrd_texture_latch_prepare (struct wxrd_texture *texture,
+                            GulkanTexture *reuse,
+                            const pixman_region32_t *damage);
+
+/* Whether the dmabuf import of texture is still running, the view should
+ * keep showing its previous texture. */
+bool
+wxrd_texture_importing (struct wxrd_texture *texture);
+
+/* Limits the upload of a shm buffer to crop, in buffer coordinates, e.g. to
+ * leave out client side shadows. gk only holds crop then. Has to be set
+ * before latching, dmabufs are never cropped. NULL uploads everything. */
+void
+wxrd_texture_set_crop (struct wxrd_texture *texture,
+                       const struct wlr_box *crop);
+
+/* Whether gk holds less than the whole buffer */
+bool
+wxrd_texture_is_cropped (struct wxrd_texture *texture);
+
+/* Returns a new lock of the client buffer gk samples directly, for dmabuf
+ * and udmabuf imports. NULL if gk holds a copy. wlroots releases the buffer
+ * when the surface commits the next one, long before the XR frames stop
+ * showing gk. */
+struct wlr_buffer *
+wxrd_texture_lock_sampled_buffer (struct wxrd_texture *texture);
+
 #endif
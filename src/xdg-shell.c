@@ -9,6 +9,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <wlr/types/wlr_xdg_decoration_v1.h>
 #include <wlr/types/wlr_xdg_shell.h>
 
 #include "input.h"
@@ -243,6 +244,64 @@ handle_new_xdg_surface (struct wl_listener *listener, void *data)
   }
 }
 
+/* Lives as long as the client's decoration object */
+struct wxrd_xdg_decoration
+{
+  struct wlr_xdg_toplevel_decoration_v1 *wlr_decoration;
+  struct wl_listener request_mode;
+  struct wl_listener destroy;
+};
+
+/* Always server side, see wxrd_view_set_client_side_decorations */
+static void
+handle_xdg_decoration_request_mode (struct wl_listener *listener, void *data)
+{
+  struct wxrd_xdg_decoration *decoration
+      = wl_container_of (listener, decoration, request_mode);
+  struct wlr_xdg_toplevel_decoration_v1 *wlr_decoration
+      = decoration->wlr_decoration;
+
+  wlr_xdg_toplevel_decoration_v1_set_mode (
+      wlr_decoration, WLR_XDG_TOPLEVEL_DECORATION_V1_MODE_SERVER_SIDE);
+
+  struct wxrd_view *view = wlr_decoration->surface->data;
+  if (view != NULL) {
+    wxrd_view_set_client_side_decorations (view, false);
+  }
+}
+
+static void
+handle_xdg_decoration_destroy (struct wl_listener *listener, void *data)
+{
+  struct wxrd_xdg_decoration *decoration
+      = wl_container_of (listener, decoration, destroy);
+  wl_list_remove (&decoration->request_mode.link);
+  wl_list_remove (&decoration->destroy.link);
+  free (decoration);
+}
+
+static void
+handle_new_xdg_decoration (struct wl_listener *listener, void *data)
+{
+  struct wlr_xdg_toplevel_decoration_v1 *wlr_decoration = data;
+
+  struct wxrd_xdg_decoration *decoration = calloc (1, sizeof (*decoration));
+  if (decoration == NULL) {
+    wlr_log (WLR_ERROR, "Allocation failed");
+    return;
+  }
+  decoration->wlr_decoration = wlr_decoration;
+
+  decoration->request_mode.notify = handle_xdg_decoration_request_mode;
+  wl_signal_add (&wlr_decoration->events.request_mode,
+                 &decoration->request_mode);
+  decoration->destroy.notify = handle_xdg_decoration_destroy;
+  wl_signal_add (&wlr_decoration->events.destroy, &decoration->destroy);
+
+  handle_xdg_decoration_request_mode (&decoration->request_mode,
+                                      wlr_decoration);
+}
+
 void
 wxrd_xdg_shell_init (struct wxrd_server *server)
 {
@@ -250,4 +309,12 @@ wxrd_xdg_shell_init (struct wxrd_server *server)
   server->new_xdg_surface.notify = handle_new_xdg_surface;
   wl_signal_add (&server->xdg_shell->events.new_surface,
                  &server->new_xdg_surface);
+
+  // clients draw no decorations into their buffers
+  server->xdg_decoration_manager
+      = wlr_xdg_decoration_manager_v1_create (server->wl_display);
+  server->new_xdg_decoration.notify = handle_new_xdg_decoration;
+  wl_signal_add (
+      &server->xdg_decoration_manager->events.new_toplevel_decoration,
+      &server->new_xdg_decoration);
 }
@@ -231,8 +231,10 @@ handle_set_decorations (struct wl_listener *listener, void *data)
   struct wxrd_view *view = &xwayland_view->view;
   struct wlr_xwayland_surface *xsurface = view->wlr_xwayland_surface;
 
-  bool csd = xsurface->decorations != WLR_XWAYLAND_SURFACE_DECORATIONS_ALL;
-  // TODO view_update_csd_from_client(view, csd);
+  // X11 clients draw their own decorations unless they leave them to the
+  // window manager, there is no way to ask them to
+  wxrd_view_set_client_side_decorations (
+      view, xsurface->decorations != WLR_XWAYLAND_SURFACE_DECORATIONS_ALL);
 }
 
 static bool